@@ -0,0 +1,125 @@
+/*
+ * descriptors-fuzz - libFuzzer target for the configuration parser
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   make descriptors-fuzz && ./descriptors-fuzz <corpus dir>
+ *
+ *   An input is a count byte, that many 16-bit little endian buffer
+ *   lengths and then the configuration descriptors back to back, cut into
+ *   buffers of those lengths. The lengths are separate from wTotalLength,
+ *   so a device that claims more than it sent is covered too. The tree is
+ *   walked afterwards so that ASan sees every pointer in it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbi.h"
+
+/* descriptors.c wants these from usb.c */
+int usb_debug = 0;
+
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
+	int value, int index, char *bytes, int size, int timeout)
+{
+  return -1;
+}
+
+static unsigned int sum_extra(const unsigned char *extra, int extralen)
+{
+  unsigned int sum = 0;
+  int i;
+
+  for (i = 0; i < extralen; i++)
+    sum += extra[i];
+  return sum;
+}
+
+static unsigned int walk_config(const struct usb_config_descriptor *config)
+{
+  unsigned int sum = sum_extra(config->extra, config->extralen);
+  int i, j, k;
+
+  if (!config->interface)
+    return sum;
+
+  for (i = 0; i < config->bNumInterfaces; i++) {
+    const struct usb_interface *interface = &config->interface[i];
+
+    for (j = 0; j < interface->num_altsetting; j++) {
+      const struct usb_interface_descriptor *as = &interface->altsetting[j];
+
+      sum += as->bInterfaceNumber + sum_extra(as->extra, as->extralen);
+      if (!as->endpoint)
+        continue;
+
+      for (k = 0; k < as->bNumEndpoints; k++)
+        sum += as->endpoint[k].bEndpointAddress + sum_extra(as->endpoint[k].extra, as->endpoint[k].extralen);
+    }
+  }
+
+  return sum;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+  unsigned char *configs[USB_MAXCONFIG];
+  int lengths[USB_MAXCONFIG];
+  struct usb_device dev;
+  volatile unsigned int sum = 0;
+  size_t offset;
+  int i, count;
+
+  if (size < 1)
+    return 0;
+
+  count = data[0] % (USB_MAXCONFIG + 1);
+  offset = 1 + 2 * count;
+  if (size < offset)
+    return 0;
+
+  /* Each buffer exactly as long as it says, so reading past it is caught */
+  for (i = 0; i < count; i++) {
+    size_t length = data[1 + 2 * i] | data[2 + 2 * i] << 8;
+
+    if (length > size - offset)
+      length = size - offset;
+    configs[i] = malloc(length ? length : 1);
+    if (!configs[i])
+      break;
+    memcpy(configs[i], data + offset, length);
+    lengths[i] = length;
+    offset += length;
+  }
+  count = i;
+
+  if (count) {
+    memset(&dev, 0, sizeof(dev));
+    dev.descriptor.bNumConfigurations = count;
+
+    usb_parse_configurations(&dev, configs, lengths, count);
+    for (i = 0; dev.config && i < count; i++)
+      sum += walk_config(&dev.config[i]);
+
+    usb_destroy_configuration(&dev);
+  }
+
+  while (count--)
+    free(configs[count]);
+  return 0;
+}
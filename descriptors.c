@@ -11,6 +11,27 @@
 #include <stdint.h>
 #include "usbi.h"
 
+/*
+ * The raw descriptors of configuration index as they were parsed, they
+ * follow the config array in the order of the configurations.
+ */
+static unsigned char *usb_config_raw(struct usb_device *dev, int index, int *len)
+{
+  unsigned char *raw;
+  int i;
+
+  if (!dev || !dev->config || index >= dev->descriptor.bNumConfigurations ||
+      !dev->config[index].wTotalLength)
+    return NULL;
+
+  raw = (unsigned char *)(dev->config + dev->descriptor.bNumConfigurations);
+  for (i = 0; i < index; i++)
+    raw += dev->config[i].wTotalLength;
+
+  *len = dev->config[index].wTotalLength;
+  return raw;
+}
+
 int usb_get_descriptor_by_endpoint(usb_dev_handle *udev, int ep,
 	unsigned char type, unsigned char index, void *buf, int size)
 {
@@ -23,8 +44,19 @@ int usb_get_descriptor_by_endpoint(usb_dev_handle *udev, int ep,
 int usb_get_descriptor(usb_dev_handle *udev, unsigned char type,
 	unsigned char index, void *buf, int size)
 {
+  unsigned char *raw;
+  int len;
+
   memset(buf, 0, size);
 
+  /* A device with other descriptors comes back as a new usb_device */
+  if (type == USB_DT_CONFIG && (raw = usb_config_raw(udev->device, index, &len))) {
+    if (size > len)
+      size = len;
+    memcpy(buf, raw, size);
+    return size;
+  }
+
   return usb_control_msg(udev, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR,
                         (type << 8) + index, 0, buf, size, 1000);
 }
@@ -67,238 +99,242 @@ int usb_parse_descriptor(unsigned char *source, const char *description, void *d
 }
 
 /*
- * This code looks surprisingly similar to the code I wrote for the Linux
- * kernel. It's not a coincidence :)
+ * Wire layouts of the standard descriptors, b a byte and w a little endian
+ * word, in the order of the struct fields. Each one expands to a decoder
+ * that does what usb_parse_descriptor does for the matching format string,
+ * without interpreting it and without reading past the buffer.
  */
+#define USB_HEADER_LAYOUT(b, w) \
+  b(bLength) b(bDescriptorType)
+
+#define USB_DEVICE_LAYOUT(b, w) \
+  USB_HEADER_LAYOUT(b, w) w(bcdUSB) b(bDeviceClass) b(bDeviceSubClass) \
+  b(bDeviceProtocol) b(bMaxPacketSize0) w(idVendor) w(idProduct) w(bcdDevice) \
+  b(iManufacturer) b(iProduct) b(iSerialNumber) b(bNumConfigurations)
+
+#define USB_CONFIG_PREFIX_LAYOUT(b, w) \
+  USB_HEADER_LAYOUT(b, w) w(wTotalLength)
+
+#define USB_CONFIG_LAYOUT(b, w) \
+  USB_CONFIG_PREFIX_LAYOUT(b, w) b(bNumInterfaces) b(bConfigurationValue) \
+  b(iConfiguration) b(bmAttributes) b(MaxPower)
+
+#define USB_INTERFACE_LAYOUT(b, w) \
+  USB_HEADER_LAYOUT(b, w) b(bInterfaceNumber) b(bAlternateSetting) \
+  b(bNumEndpoints) b(bInterfaceClass) b(bInterfaceSubClass) \
+  b(bInterfaceProtocol) b(iInterface)
+
+#define USB_ENDPOINT_LAYOUT(b, w) \
+  USB_HEADER_LAYOUT(b, w) b(bEndpointAddress) b(bmAttributes) \
+  w(wMaxPacketSize) b(bInterval)
+
+#define USB_ENDPOINT_AUDIO_LAYOUT(b, w) \
+  USB_ENDPOINT_LAYOUT(b, w) b(bRefresh) b(bSynchAddress)
+
+#define USB_LAYOUT_SIZE_B(field)	+ 1
+#define USB_LAYOUT_SIZE_W(field)	+ 2
+#define USB_LAYOUT_SIZE(layout)		(0 layout(USB_LAYOUT_SIZE_B, USB_LAYOUT_SIZE_W))
+
+#define USB_DECODE_B(field)	dest->field = sp[0]; sp += 1;
+#define USB_DECODE_W(field)	dest->field = sp[0] | (sp[1] << 8); sp += 2;
+
+/* Fails with -1 rather than reading past size bytes */
+#define USB_DEFINE_DECODER(name, type, layout) \
+int name(const unsigned char *buffer, int size, type *dest) \
+{ \
+  const unsigned char *sp = buffer; \
+  \
+  if (size < USB_LAYOUT_SIZE(layout)) \
+    return -1; \
+  layout(USB_DECODE_B, USB_DECODE_W) \
+  return sp - buffer; \
+}
 
-static int usb_parse_endpoint(struct usb_endpoint_descriptor *endpoint, unsigned char *buffer, int size)
-{
-  struct usb_descriptor_header header;
-  unsigned char *begin;
-  int parsed = 0, len, numskipped;
-
-  usb_parse_descriptor(buffer, "bb", &header);
+USB_DEFINE_DECODER(usb_decode_header, struct usb_descriptor_header, USB_HEADER_LAYOUT)
+USB_DEFINE_DECODER(usb_decode_device, struct usb_device_descriptor, USB_DEVICE_LAYOUT)
+USB_DEFINE_DECODER(usb_decode_config_prefix, struct usb_config_descriptor, USB_CONFIG_PREFIX_LAYOUT)
+USB_DEFINE_DECODER(usb_decode_config, struct usb_config_descriptor, USB_CONFIG_LAYOUT)
+USB_DEFINE_DECODER(usb_decode_interface, struct usb_interface_descriptor, USB_INTERFACE_LAYOUT)
+USB_DEFINE_DECODER(usb_decode_endpoint, struct usb_endpoint_descriptor, USB_ENDPOINT_LAYOUT)
+USB_DEFINE_DECODER(usb_decode_endpoint_audio, struct usb_endpoint_descriptor, USB_ENDPOINT_AUDIO_LAYOUT)
+
+/* The layouts have to agree with the sizes the rest of the code uses */
+typedef char usb_layout_check[(USB_LAYOUT_SIZE(USB_HEADER_LAYOUT) == DESC_HEADER_LENGTH &&
+                               USB_LAYOUT_SIZE(USB_DEVICE_LAYOUT) == USB_DT_DEVICE_SIZE &&
+                               USB_LAYOUT_SIZE(USB_CONFIG_LAYOUT) == USB_DT_CONFIG_SIZE &&
+                               USB_LAYOUT_SIZE(USB_INTERFACE_LAYOUT) == USB_DT_INTERFACE_SIZE &&
+                               USB_LAYOUT_SIZE(USB_ENDPOINT_LAYOUT) == USB_DT_ENDPOINT_SIZE &&
+                               USB_LAYOUT_SIZE(USB_ENDPOINT_AUDIO_LAYOUT) == USB_DT_ENDPOINT_AUDIO_SIZE) ? 1 : -1];
 
-  /* Everything should be fine being passed into here, but we sanity */
-  /*  check JIC */
-  if (header.bLength > size) {
-    if (usb_debug >= 1)
-      fprintf(stderr, "ran out of descriptors parsing\n");
-    return -1;
-  }
+/*
+ * Walks the descriptors of a configuration one at a time. Each bLength is
+ * checked against what is left of the buffer, and against the size of the
+ * standard descriptors, so a descriptor the iterator returns can always be
+ * decoded by its type.
+ */
+void usb_descriptor_iter_init(struct usb_descriptor_iter *iter, unsigned char *buffer, int size)
+{
+  iter->buffer = buffer;
+  iter->size = size;
+  iter->offset = 0;
+}
 
-  if (header.bDescriptorType != USB_DT_ENDPOINT) {
-    if (usb_debug >= 2)
-      fprintf(stderr, "unexpected descriptor 0x%X, expecting endpoint descriptor, type 0x%X\n",
-         header.bDescriptorType, USB_DT_ENDPOINT);
-    return parsed;
+static int usb_descriptor_min_length(int type)
+{
+  switch (type) {
+  case USB_DT_DEVICE:
+    return USB_DT_DEVICE_SIZE;
+  case USB_DT_CONFIG:
+    return USB_DT_CONFIG_SIZE;
+  case USB_DT_INTERFACE:
+    return USB_DT_INTERFACE_SIZE;
+  case USB_DT_ENDPOINT:
+    return USB_DT_ENDPOINT_SIZE;
   }
 
-  if (header.bLength >= ENDPOINT_AUDIO_DESC_LENGTH)
-    usb_parse_descriptor(buffer, "bbbbwbbb", endpoint);
-  else if (header.bLength >= ENDPOINT_DESC_LENGTH)
-    usb_parse_descriptor(buffer, "bbbbwb", endpoint);
-
-  buffer += header.bLength;
-  size -= header.bLength;
-  parsed += header.bLength;
-
-  /* Skip over the rest of the Class Specific or Vendor Specific */
-  /*  descriptors */
-  begin = buffer;
-  numskipped = 0;
-  while (size >= DESC_HEADER_LENGTH) {
-    usb_parse_descriptor(buffer, "bb", &header);
-
-    if (header.bLength < 2) {
-      if (usb_debug >= 1)
-        fprintf(stderr, "invalid descriptor length of %d\n", header.bLength);
-      return -1;
-    }
-
-    /* If we find another "proper" descriptor then we're done  */
-    if ((header.bDescriptorType == USB_DT_ENDPOINT) ||
-        (header.bDescriptorType == USB_DT_INTERFACE) ||
-        (header.bDescriptorType == USB_DT_CONFIG) ||
-        (header.bDescriptorType == USB_DT_DEVICE))
-      break;
-
-    if (usb_debug >= 1)
-      fprintf(stderr, "skipping descriptor 0x%X\n", header.bDescriptorType);
-    numskipped++;
+  return DESC_HEADER_LENGTH;
+}
 
-    buffer += header.bLength;
-    size -= header.bLength;
-    parsed += header.bLength;
-  }
+/* 1 with the next header and its offset, 0 at the end, -1 if it's invalid */
+int usb_descriptor_next(struct usb_descriptor_iter *iter, struct usb_descriptor_header *header, int *offset)
+{
+  int left = iter->size - iter->offset;
 
-  if (numskipped && usb_debug >= 2)
-    fprintf(stderr, "skipped %d class/vendor specific endpoint descriptors\n", numskipped);
-
-  /* Copy any unknown descriptors into a storage area for drivers */
-  /*  to later parse */
-  len = (int)(buffer - begin);
-  if (!len) {
-    endpoint->extra = NULL;
-    endpoint->extralen = 0;
-    return parsed;
-  }
+  if (usb_decode_header(iter->buffer + iter->offset, left, header) < 0)
+    return 0;
 
-  endpoint->extra = malloc(len);
-  if (!endpoint->extra) {
+  if ((header->bLength > left) || (header->bLength < usb_descriptor_min_length(header->bDescriptorType))) {
     if (usb_debug >= 1)
-      fprintf(stderr, "couldn't allocate memory for endpoint extra descriptors\n");
-    endpoint->extralen = 0;
-    return parsed;
+      fprintf(stderr, "invalid descriptor length of %d for descriptor 0x%X\n", header->bLength, header->bDescriptorType);
+    return -1;
   }
 
-  memcpy(endpoint->extra, begin, len);
-  endpoint->extralen = len;
-
-  return parsed;
+  *offset = iter->offset;
+  iter->offset += header->bLength;
+  return 1;
 }
 
-static int usb_parse_interface(struct usb_interface *interface,
-	unsigned char *buffer, int size)
+/*
+ * The whole configuration tree of a device comes out of one block: the
+ * config array first, so freeing dev->config frees everything, then a copy
+ * of the raw configuration descriptors back to back, which the extra
+ * pointers point into and usb_get_descriptor answers from, then the
+ * interfaces, altsettings and endpoints. Each part is handed out in order,
+ * so the altsettings of an interface stay contiguous even though they are
+ * found one at a time. usb_count_configuration sizes the parts from the
+ * raw descriptors before anything is parsed.
+ */
+struct usb_config_arena {
+  struct usb_interface *interface, *interface_end;
+  struct usb_interface_descriptor *altsetting, *altsetting_end;
+  struct usb_endpoint_descriptor *endpoint, *endpoint_end;
+};
+
+struct usb_config_counts {
+  int interfaces;
+  int altsettings;
+  int endpoints;
+  int raw;
+};
+
+/*
+ * Upper bounds for what usb_parse_configuration takes from the arena: an
+ * altsetting and its endpoints for every interface descriptor up to where
+ * the parser stops at the latest.
+ */
+static void usb_count_configuration(unsigned char *buffer, struct usb_config_counts *counts)
 {
-  int i, len, numskipped, retval, parsed = 0;
+  struct usb_descriptor_iter iter;
   struct usb_descriptor_header header;
-  struct usb_interface_descriptor *ifp;
-  unsigned char *begin;
-
-  interface->num_altsetting = 0;
-
-  while (size >= INTERFACE_DESC_LENGTH) {
-    interface->altsetting = realloc(interface->altsetting, sizeof(struct usb_interface_descriptor) * (interface->num_altsetting + 1));
-    if (!interface->altsetting) {
-      if (usb_debug >= 1)
-        fprintf(stderr, "couldn't malloc interface->altsetting\n");
-      return -1;
-    }
-
-    ifp = interface->altsetting + interface->num_altsetting;
-    interface->num_altsetting++;
+  struct usb_config_descriptor config;
+  struct usb_interface_descriptor ifp;
+  int offset;
 
-    usb_parse_descriptor(buffer, "bbbbbbbbb", ifp);
+  usb_decode_config(buffer, CONFIG_DESC_LENGTH, &config);
 
-    /* Skip over the interface */
-    buffer += ifp->bLength;
-    parsed += ifp->bLength;
-    size -= ifp->bLength;
+  if (config.bNumInterfaces <= USB_MAXINTERFACES)
+    counts->interfaces += config.bNumInterfaces;
+  counts->raw += config.wTotalLength;
 
-    begin = buffer;
-    numskipped = 0;
-
-    /* Skip over any interface, class or vendor descriptors */
-    while (size >= DESC_HEADER_LENGTH) {
-      usb_parse_descriptor(buffer, "bb", &header);
-
-      if (header.bLength < 2) {
-        if (usb_debug >= 1)
-          fprintf(stderr, "invalid descriptor length of %d\n", header.bLength);
-        return -1;
-      }
-
-      /* If we find another "proper" descriptor then we're done */
-      if ((header.bDescriptorType == USB_DT_INTERFACE) ||
-          (header.bDescriptorType == USB_DT_ENDPOINT) ||
-          (header.bDescriptorType == USB_DT_CONFIG) ||
-          (header.bDescriptorType == USB_DT_DEVICE))
-        break;
+  usb_descriptor_iter_init(&iter, buffer, config.wTotalLength);
+  if (usb_descriptor_next(&iter, &header, &offset) <= 0)
+    return;
 
-      numskipped++;
+  while (usb_descriptor_next(&iter, &header, &offset) > 0) {
+    if ((header.bDescriptorType == USB_DT_CONFIG) ||
+        (header.bDescriptorType == USB_DT_DEVICE))
+      break;
 
-      buffer += header.bLength;
-      parsed += header.bLength;
-      size -= header.bLength;
+    if (header.bDescriptorType == USB_DT_INTERFACE) {
+      usb_decode_interface(buffer + offset, header.bLength, &ifp);
+      counts->altsettings++;
+      counts->endpoints += ifp.bNumEndpoints < USB_MAXENDPOINTS ? ifp.bNumEndpoints : USB_MAXENDPOINTS;
     }
+  }
+}
 
-    if (numskipped && usb_debug >= 2)
-      fprintf(stderr, "skipped %d class/vendor specific interface descriptors\n", numskipped);
-
-    /* Copy any unknown descriptors into a storage area for */
-    /*  drivers to later parse */
-    len = (int)(buffer - begin);
-    if (!len) {
-      ifp->extra = NULL;
-      ifp->extralen = 0;
-    } else {
-      ifp->extra = malloc(len);
-      if (!ifp->extra) {
-        if (usb_debug >= 1)
-          fprintf(stderr, "couldn't allocate memory for interface extra descriptors\n");
-        ifp->extralen = 0;
-        return -1;
-      }
-      memcpy(ifp->extra, begin, len);
-      ifp->extralen = len;
-    }
+static struct usb_interface_descriptor *usb_arena_altsetting(struct usb_config_arena *arena)
+{
+  if (arena->altsetting == arena->altsetting_end)
+    return NULL;
 
-    /* Did we hit an unexpected descriptor? */
-    usb_parse_descriptor(buffer, "bb", &header);
-    if ((size >= DESC_HEADER_LENGTH) &&
-        ((header.bDescriptorType == USB_DT_CONFIG) ||
-        (header.bDescriptorType == USB_DT_DEVICE)))
-      return parsed;
+  return arena->altsetting++;
+}
 
-    if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
-      if (usb_debug >= 1)
-        fprintf(stderr, "too many endpoints\n");
-      return -1;
-    }
+static struct usb_endpoint_descriptor *usb_arena_endpoints(struct usb_config_arena *arena, int count)
+{
+  struct usb_endpoint_descriptor *endpoint = arena->endpoint;
 
-    if (ifp->bNumEndpoints > 0) {
-      ifp->endpoint = (struct usb_endpoint_descriptor *)
-                       malloc(ifp->bNumEndpoints *
-                       sizeof(struct usb_endpoint_descriptor));
-      if (!ifp->endpoint) {
-        if (usb_debug >= 1)
-          fprintf(stderr, "couldn't allocate memory for ifp->endpoint\n");
-        return -1;      
-      }
+  if (count > arena->endpoint_end - arena->endpoint)
+    return NULL;
 
-      memset(ifp->endpoint, 0, ifp->bNumEndpoints *
-             sizeof(struct usb_endpoint_descriptor));
+  arena->endpoint += count;
+  return endpoint;
+}
 
-      for (i = 0; i < ifp->bNumEndpoints; i++) {
-        usb_parse_descriptor(buffer, "bb", &header);
-  
-        if (header.bLength > size) {
-          if (usb_debug >= 1)
-            fprintf(stderr, "ran out of descriptors parsing\n");
-          return -1;
-        }
-                
-        retval = usb_parse_endpoint(ifp->endpoint + i, buffer, size);
-        if (retval < 0)
-          return retval;
-
-        buffer += retval;
-        parsed += retval;
-        size -= retval;
-      }
-    } else
-      ifp->endpoint = NULL;
-
-    /* We check to see if it's an alternate to this one */
-    ifp = (struct usb_interface_descriptor *)buffer;
-    if (size < USB_DT_INTERFACE_SIZE ||
-        ifp->bDescriptorType != USB_DT_INTERFACE ||
-        !ifp->bAlternateSetting)
-      return parsed;
-  }
+/*
+ * Points the last standard descriptor before the class and vendor ones
+ * from begin to end at them: the endpoint, else the altsetting, else the
+ * config. They stay in the raw copy, nothing is allocated.
+ */
+static void usb_set_extra(struct usb_config_descriptor *config, struct usb_interface_descriptor *ifp,
+	struct usb_endpoint_descriptor *endpoint, unsigned char *begin, unsigned char *end)
+{
+  if (begin == end)
+    return;
 
-  return parsed;
+  if (endpoint) {
+    endpoint->extra = begin;
+    endpoint->extralen = end - begin;
+  } else if (ifp) {
+    ifp->extra = begin;
+    ifp->extralen = end - begin;
+  } else {
+    config->extra = begin;
+    config->extralen = end - begin;
+  }
 }
 
-int usb_parse_configuration(struct usb_config_descriptor *config,
-	unsigned char *buffer)
+/*
+ * One pass over the descriptors. An interface descriptor with
+ * bAlternateSetting 0 starts the next interface, any other one adds an
+ * altsetting to the current interface, and endpoint descriptors fill the
+ * endpoints of the last altsetting. Everything else, and endpoints beyond
+ * bNumEndpoints, is extra of the last of those, or of the config before
+ * the first interface. Returns how many bytes were left unparsed, or -1.
+ */
+static int usb_parse_configuration(struct usb_config_descriptor *config,
+	unsigned char *buffer, struct usb_config_arena *arena)
 {
-  int i, retval, size;
+  struct usb_descriptor_iter iter;
   struct usb_descriptor_header header;
+  struct usb_interface *interface = NULL;
+  struct usb_interface_descriptor *ifp = NULL;
+  struct usb_endpoint_descriptor *endpoint = NULL;
+  unsigned char *begin;
+  int offset, res, numendpoints = 0, numskipped = 0;
 
-  usb_parse_descriptor(buffer, "bbwbbbbb", config);
-  size = config->wTotalLength;
+  usb_decode_config(buffer, CONFIG_DESC_LENGTH, config);
 
   if (config->bNumInterfaces > USB_MAXINTERFACES) {
     if (usb_debug >= 1)
@@ -306,134 +342,191 @@ int usb_parse_configuration(struct usb_config_descriptor *config,
     return -1;
   }
 
-  config->interface = (struct usb_interface *)
-                       malloc(config->bNumInterfaces *
-                       sizeof(struct usb_interface));
-  if (!config->interface) {
+  if (config->bNumInterfaces > arena->interface_end - arena->interface) {
     if (usb_debug >= 1)
       fprintf(stderr, "out of memory\n");
-    return -1;      
+    return -1;
   }
 
-  memset(config->interface, 0, config->bNumInterfaces * sizeof(struct usb_interface));
+  config->interface = arena->interface;
+  arena->interface += config->bNumInterfaces;
 
-  buffer += config->bLength;
-  size -= config->bLength;
-        
   config->extra = NULL;
   config->extralen = 0;
 
-  for (i = 0; i < config->bNumInterfaces; i++) {
-    int numskipped, len;
-    unsigned char *begin;
+  usb_descriptor_iter_init(&iter, buffer, config->wTotalLength);
+  if (usb_descriptor_next(&iter, &header, &offset) <= 0)
+    return -1;
+
+  begin = buffer + iter.offset;
 
-    /* Skip over the rest of the Class Specific or Vendor */
-    /*  Specific descriptors */
-    begin = buffer;
-    numskipped = 0;
-    while (size >= DESC_HEADER_LENGTH) {
-      usb_parse_descriptor(buffer, "bb", &header);
+  while ((res = usb_descriptor_next(&iter, &header, &offset)) > 0) {
+    unsigned char *desc = buffer + offset;
 
-      if ((header.bLength > size) || (header.bLength < DESC_HEADER_LENGTH)) {
+    if ((header.bDescriptorType == USB_DT_CONFIG) ||
+        (header.bDescriptorType == USB_DT_DEVICE))
+      break;
+
+    if (header.bDescriptorType == USB_DT_INTERFACE) {
+      struct usb_interface_descriptor *alt = usb_arena_altsetting(arena);
+
+      if (!alt) {
         if (usb_debug >= 1)
-          fprintf(stderr, "invalid descriptor length of %d\n", header.bLength);
+          fprintf(stderr, "couldn't malloc interface->altsetting\n");
         return -1;
       }
 
-      /* If we find another "proper" descriptor then we're done */
-      if ((header.bDescriptorType == USB_DT_ENDPOINT) ||
-          (header.bDescriptorType == USB_DT_INTERFACE) ||
-          (header.bDescriptorType == USB_DT_CONFIG) ||
-          (header.bDescriptorType == USB_DT_DEVICE))
-        break;
+      usb_decode_interface(desc, header.bLength, alt);
+
+      if (!alt->bAlternateSetting || !interface) {
+        /* One interface more than the config has, the rest is left over */
+        if (interface == config->interface + config->bNumInterfaces - 1 || !config->bNumInterfaces)
+          break;
+        interface = interface ? interface + 1 : config->interface;
+      }
+
+      usb_set_extra(config, ifp, endpoint, begin, desc);
 
-      if (usb_debug >= 2)
-        fprintf(stderr, "skipping descriptor 0x%X\n", header.bDescriptorType);
-      numskipped++;
+      ifp = alt;
+      endpoint = NULL;
 
-      buffer += header.bLength;
-      size -= header.bLength;
-    }
+      if (!interface->num_altsetting)
+        interface->altsetting = ifp;
+      interface->num_altsetting++;
 
-    if (numskipped && usb_debug >= 2)
-      fprintf(stderr, "skipped %d class/vendor specific endpoint descriptors\n", numskipped);
-
-    /* Copy any unknown descriptors into a storage area for */
-    /*  drivers to later parse */
-    len = (int)(buffer - begin);
-    if (len) {
-      /* FIXME: We should realloc and append here */
-      if (!config->extralen) {
-        config->extra = malloc(len);
-        if (!config->extra) {
+      if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
+        if (usb_debug >= 1)
+          fprintf(stderr, "too many endpoints\n");
+        return -1;
+      }
+
+      if (ifp->bNumEndpoints > 0) {
+        ifp->endpoint = usb_arena_endpoints(arena, ifp->bNumEndpoints);
+        if (!ifp->endpoint) {
           if (usb_debug >= 1)
-            fprintf(stderr, "couldn't allocate memory for config extra descriptors\n");
-          config->extralen = 0;
+            fprintf(stderr, "couldn't allocate memory for ifp->endpoint\n");
           return -1;
         }
-
-        memcpy(config->extra, begin, len);
-        config->extralen = len;
       }
+      numendpoints = 0;
+      begin = desc + header.bLength;
+      continue;
     }
 
-    retval = usb_parse_interface(config->interface + i, buffer, size);
-    if (retval < 0)
-      return retval;
+    if (header.bDescriptorType == USB_DT_ENDPOINT && ifp && numendpoints < ifp->bNumEndpoints) {
+      usb_set_extra(config, ifp, endpoint, begin, desc);
+
+      endpoint = ifp->endpoint + numendpoints++;
+      if (header.bLength >= ENDPOINT_AUDIO_DESC_LENGTH)
+        usb_decode_endpoint_audio(desc, header.bLength, endpoint);
+      else
+        usb_decode_endpoint(desc, header.bLength, endpoint);
+
+      begin = desc + header.bLength;
+      continue;
+    }
 
-    buffer += retval;
-    size -= retval;
+    if (usb_debug >= 2)
+      fprintf(stderr, "skipping descriptor 0x%X\n", header.bDescriptorType);
+    numskipped++;
   }
 
-  return size;
+  if (res < 0)
+    return -1;
+
+  if (numskipped && usb_debug >= 2)
+    fprintf(stderr, "skipped %d class/vendor specific descriptors\n", numskipped);
+
+  /* Up to where the loop stopped, the whole buffer if it ran out */
+  if (!res)
+    offset = iter.offset;
+  usb_set_extra(config, ifp, endpoint, begin, buffer + offset);
+
+  return config->wTotalLength - offset;
 }
 
-void usb_destroy_configuration(struct usb_device *dev)
+/*
+ * Parses count raw configuration descriptors, buffers[i] being lengths[i]
+ * bytes, into a new dev->config. A configuration whose wTotalLength doesn't
+ * fit its buffer ends the set there. Configurations past that are left
+ * empty.
+ */
+int usb_parse_configurations(struct usb_device *dev, unsigned char **buffers, const int *lengths, int count)
 {
-  int c, i, j, k;
-        
-  if (!dev->config)
-    return;
+  struct usb_config_counts counts = { 0, 0, 0, 0 };
+  struct usb_config_arena arena;
+  unsigned char *raw;
+  size_t size;
+  int i, res;
+
+  /* Everything after this trusts wTotalLength */
+  for (i = 0; i < count; i++) {
+    struct usb_config_descriptor config;
 
-  for (c = 0; c < dev->descriptor.bNumConfigurations; c++) {
-    struct usb_config_descriptor *cf = &dev->config[c];
+    if (usb_decode_config_prefix(buffers[i], lengths[i], &config) < 0 ||
+        config.wTotalLength < CONFIG_DESC_LENGTH || config.wTotalLength > lengths[i]) {
+      if (usb_debug >= 1)
+        fprintf(stderr, "Config descriptor %d doesn't fit its buffer (%d bytes)\n", i, lengths[i]);
+      break;
+    }
+  }
+  count = i;
 
-    if (!cf->interface)
-      continue;
+  for (i = 0; i < count; i++)
+    usb_count_configuration(buffers[i], &counts);
 
-    for (i = 0; i < cf->bNumInterfaces; i++) {
-      struct usb_interface *ifp = &cf->interface[i];
-                                
-      if (!ifp->altsetting)
-        continue;
-
-      for (j = 0; j < ifp->num_altsetting; j++) {
-        struct usb_interface_descriptor *as = &ifp->altsetting[j];
-                                        
-        if (as->extra)
-          free(as->extra);
-
-        if (!as->endpoint)
-          continue;
-                                        
-        for (k = 0; k < as->bNumEndpoints; k++) {
-          if (as->endpoint[k].extra)
-            free(as->endpoint[k].extra);
-        }       
-        free(as->endpoint);
-      }
+  size = dev->descriptor.bNumConfigurations * sizeof(struct usb_config_descriptor) +
+         counts.interfaces * sizeof(struct usb_interface) +
+         counts.altsettings * sizeof(struct usb_interface_descriptor) +
+         counts.endpoints * sizeof(struct usb_endpoint_descriptor) +
+         counts.raw;
 
-      free(ifp->altsetting);
-    }
+  /* The structs are byte packed, the parts need no alignment */
+  dev->config = calloc(1, size);
+  if (!dev->config) {
+    if (usb_debug >= 1)
+      fprintf(stderr, "Unable to allocate memory for config descriptor\n");
+    return -1;
+  }
+
+  raw = (unsigned char *)(dev->config + dev->descriptor.bNumConfigurations);
+  arena.interface = (struct usb_interface *)(raw + counts.raw);
+  arena.interface_end = arena.interface + counts.interfaces;
+  arena.altsetting = (struct usb_interface_descriptor *)arena.interface_end;
+  arena.altsetting_end = arena.altsetting + counts.altsettings;
+  arena.endpoint = (struct usb_endpoint_descriptor *)arena.altsetting_end;
+  arena.endpoint_end = arena.endpoint + counts.endpoints;
 
-    free(cf->interface);
+  for (i = 0; i < count; i++) {
+    struct usb_config_descriptor config;
+
+    usb_decode_config_prefix(buffers[i], CONFIG_DESC_LENGTH, &config);
+    memcpy(raw, buffers[i], config.wTotalLength);
+
+    res = usb_parse_configuration(&dev->config[i], raw, &arena);
+    raw += config.wTotalLength;
+    if (usb_debug >= 2) {
+      if (res > 0)
+        fprintf(stderr, "Descriptor data still left\n");
+      else if (res < 0)
+        fprintf(stderr, "Unable to parse descriptors\n");
+    }
   }
 
+  return 0;
+}
+
+/* The tree is a single block, see usb_parse_configurations */
+void usb_destroy_configuration(struct usb_device *dev)
+{
   free(dev->config);
+  dev->config = NULL;
 }
 
 void usb_fetch_and_parse_descriptors(usb_dev_handle *udev)
 {
+  unsigned char *bigbuffers[USB_MAXCONFIG];
+  int lengths[USB_MAXCONFIG];
   struct usb_device *dev = udev->device;
   int i;
 
@@ -449,19 +542,10 @@ void usb_fetch_and_parse_descriptors(usb_dev_handle *udev)
     return;
   }
 
-  dev->config = (struct usb_config_descriptor *)malloc(dev->descriptor.bNumConfigurations * sizeof(struct usb_config_descriptor));
-  if (!dev->config) {
-    if (usb_debug >= 1)
-      fprintf(stderr, "Unable to allocate memory for config descriptor\n");
-    return;
-  }
-
-  memset(dev->config, 0, dev->descriptor.bNumConfigurations *
-	sizeof(struct usb_config_descriptor));
-
+  /* All of them first, the arena is sized from the whole set */
   for (i = 0; i < dev->descriptor.bNumConfigurations; i++) {
     unsigned char buffer[8], *bigbuffer;
-    struct usb_config_descriptor config;
+    struct usb_config_descriptor config, full;
     int res;
 
     /* Get the first 8 bytes so we can figure out what the total length is */
@@ -477,7 +561,12 @@ void usb_fetch_and_parse_descriptors(usb_dev_handle *udev)
       goto err;
     }
 
-    usb_parse_descriptor(buffer, "bbw", &config);
+    usb_decode_config_prefix(buffer, res, &config);
+    if (config.wTotalLength < CONFIG_DESC_LENGTH) {
+      if (usb_debug >= 1)
+        fprintf(stderr, "Config descriptor too short (expected %d, got %d)\n", CONFIG_DESC_LENGTH, config.wTotalLength);
+      goto err;
+    }
 
     bigbuffer = malloc(config.wTotalLength);
     if (!bigbuffer) {
@@ -499,22 +588,23 @@ void usb_fetch_and_parse_descriptors(usb_dev_handle *udev)
       goto err;
     }
 
-    res = usb_parse_configuration(&dev->config[i], bigbuffer);
-    if (usb_debug >= 2) {
-      if (res > 0)
-        fprintf(stderr, "Descriptor data still left\n");
-      else if (res < 0)
-        fprintf(stderr, "Unable to parse descriptors\n");
+    /* The device may answer differently the second time, res covers the prefix */
+    usb_decode_config_prefix(bigbuffer, res, &full);
+    if (full.wTotalLength != config.wTotalLength) {
+      if (usb_debug >= 1)
+        fprintf(stderr, "Config descriptor changed length (%d, then %d)\n", config.wTotalLength, full.wTotalLength);
+
+      free(bigbuffer);
+      goto err;
     }
 
-    free(bigbuffer);
+    bigbuffers[i] = bigbuffer;
+    lengths[i] = config.wTotalLength;
   }
 
-  return;
+  usb_parse_configurations(dev, bigbuffers, lengths, i);
 
 err:
-  free(dev->config);
-
-  dev->config = NULL;
+  while (i--)
+    free(bigbuffers[i]);
 }
-
@@ -25,7 +25,17 @@
 @ cdecl usb_get_busses                 ()
 @ cdecl usb_get_version                ()
 @ cdecl usb_bulk_setup_async           (ptr ptr long)
+@ cdecl usb_interrupt_setup_async      (ptr ptr long)
+@ cdecl usb_isochronous_setup_async    (ptr ptr long long)
 @ cdecl usb_submit_async               (ptr ptr long)
 @ cdecl usb_reap_async                 (ptr long)
+@ cdecl usb_reap_async_nocancel        (ptr long)
 @ cdecl usb_free_async                 (ptr)
 @ cdecl usb_cancel_async               (ptr)
+@ cdecl usb_alloc_buffer_np            (ptr long)
+@ cdecl usb_free_buffer_np             (ptr ptr)
+@ cdecl usb_get_stats_np               (ptr ptr long)
+@ cdecl usb_hotplug_event_np           ()
+@ cdecl usb_hotplug_register_np        (ptr ptr)
+@ cdecl usb_hotplug_unregister_np      (ptr ptr)
+@ cdecl usb_isochronous_get_packets_np (ptr ptr long)
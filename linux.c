@@ -39,20 +39,6 @@ static int x_close( int fd )
     return p.ret;
 }
 
-static int x_read( int fd, void * dst, size_t count )
-{
-    struct prm_read p = { -1, fd, dst, count };
-    WINE_UNIX_CALL( unix_read, &p );
-    return p.ret;
-}
-
-static int x_ioctl( int fd, unsigned long id, void * arg )
-{
-    struct prm_ioctl p = { -1, fd, id, arg };
-    WINE_UNIX_CALL( unix_ioctl, &p );
-    return p.ret;
-}
-
 static char usb_path[LIBUSB_PATH_MAX + 1] = "";
 
 static int device_open(struct usb_device *dev)
@@ -174,215 +160,257 @@ int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int t
     return usb_urb_transfer(dev, ep, USB_URB_TYPE_INTERRUPT, bytes, size, timeout);
 }
 
-int usb_os_find_busses( struct usb_bus **busses )
+/*
+ * What we keep in usb_device.dev: a stamp of the device when it was read,
+ * the inode and ctime of its sysfs directory or usbfs node. Both are
+ * created anew for every device that shows up, so as long as the stamp
+ * stays the same the descriptors we have are still good.
+ */
+struct linux_device
 {
-    struct usb_bus *fbus = NULL;
-    char dirpath[LIBUSB_PATH_MAX + 1];
-    WIN32_FIND_DATAA ffd;
-    char *d_name = ffd.cFileName;
-    HANDLE hFind;
+    uint64_t stamp[2];
+};
 
-    snprintf( dirpath, LIBUSB_PATH_MAX, "//?/unix/%s/*", usb_path );
-
-    hFind = FindFirstFileA( dirpath, &ffd );
-
-    if( hFind == INVALID_HANDLE_VALUE )
-	USB_ERROR_STR( -errno, "couldn't opendir(%s): %lX", dirpath, GetLastError() );
+/* The device in known by filename, if its stamp hasn't changed since */
+static struct usb_device *find_known_device( struct usb_index *known, const char *filename, const uint64_t stamp[2] )
+{
+    struct usb_device *dev = usb_index_find( known, filename );
+    const struct linux_device *ldev;
 
-    do {
-	struct usb_bus *bus;
+    if( !dev || !( ldev = dev->dev ) ) return NULL;
+    return ldev->stamp[0] == stamp[0] && ldev->stamp[1] == stamp[1] ? dev : NULL;
+}
 
-	/* Skip anything starting with a . */
-	if( d_name[0] == '.' ) continue;
-	/* Skip anything not ending with digit */
-	if( !strchr( "0123456789", d_name[strlen(d_name) - 1] ) ) continue;
+static int set_stamp( struct usb_device *dev, const uint64_t stamp[2] )
+{
+    struct linux_device *ldev = malloc( sizeof(*ldev) );
 
-	bus = malloc(sizeof(*bus));
-	if( !bus ) USB_ERROR( -ENOMEM );
+    if( !ldev ) return -ENOMEM;
+    ldev->stamp[0] = stamp[0];
+    ldev->stamp[1] = stamp[1];
+    dev->dev = ldev;
+    return 0;
+}
 
-	memset((void *)bus, 0, sizeof(*bus));
-	lstrcpynA( bus->dirname, d_name, sizeof(bus->dirname) - 1 );
-	bus->dirname[sizeof(bus->dirname) - 1] = 0;
-	LIST_ADD( fbus, bus );
+/* A stand-in for known, which usb_find_devices keeps instead */
+static void make_stub( struct usb_device *dev, const struct usb_device *known )
+{
+    dev->devnum = known->devnum;
+    dev->descriptor = known->descriptor;
+}
 
-	if( usb_debug >= 2 ) fprintf(stderr, "usb_os_find_busses: Found %s\n", bus->dirname);
+/*
+ * Last result of unix_usb_scan. The scan has every device of every bus with
+ * its descriptors and, for hubs, what is on their ports, all in one unix
+ * call; from sysfs without opening anything but hubs, or else from usbfs.
+ * It is taken when the busses are listed and again at the start of every
+ * device scan that doesn't directly follow that. While the hotplug monitor
+ * sees no device come or go the unix call keeps the last one instead.
+ */
+static unsigned char *scan_buffer;
+static unsigned int scan_size, scan_used;
+static unsigned int scan_generation;
+static int scan_fresh;
 
-  } while( FindNextFileA( hFind, &ffd ) );
+static int usb_scan(void)
+{
+    struct prm_usb_scan p;
 
-  FindClose( hFind );
+    for( ;; )
+    {
+	unsigned char *buffer;
+
+	p.ret = -1;
+	p.path = usb_path;
+	p.size = scan_size;
+	p.buffer = scan_buffer;
+	p.generation = scan_generation;
+	p.unchanged = 0;
+	WINE_UNIX_CALL( unix_usb_scan, &p );
+	if( p.ret < 0 )
+	    USB_ERROR_STR( p.ret, "couldn't scan for devices: %s", strerror(-p.ret) );
+	if( p.unchanged ) return 0;
+	if( p.ret <= scan_size ) break;
+
+	/* Some room to spare for devices that show up meanwhile */
+	if( !( buffer = realloc( scan_buffer, p.ret + 4096 ) ) ) return -ENOMEM;
+	scan_buffer = buffer;
+	scan_size = p.ret + 4096;
+    }
+    scan_used = p.ret;
+    scan_generation = p.generation;
+    return 0;
+}
 
-  *busses = fbus;
+static const struct usb_scan_device *scan_next( const struct usb_scan_device *entry )
+{
+    const unsigned char *next = entry ? (const unsigned char *)entry + entry->size : scan_buffer;
 
-  return 0;
+    entry = (const struct usb_scan_device *)next;
+    if( next + sizeof(*entry) > scan_buffer + scan_used || entry->size < sizeof(*entry) ||
+	entry->size > scan_buffer + scan_used - next ||
+	entry->desc_length + entry->numports > entry->size - sizeof(*entry) )
+	return NULL;
+    return entry;
 }
 
-int usb_os_find_devices(struct usb_bus *bus, struct usb_device **devices)
+
+/* Device and configuration descriptors from the raw ones sysfs has */
+static void parse_descriptors( struct usb_device *dev, unsigned char *desc, unsigned int len )
 {
-    struct usb_device *fdev = NULL;
-    char dirpath[LIBUSB_PATH_MAX + 1];
-    WIN32_FIND_DATAA ffd;
-    char *d_name = ffd.cFileName;
-    HANDLE hFind;
+    unsigned char *configs[USB_MAXCONFIG];
+    int lengths[USB_MAXCONFIG];
+    unsigned int i, offset = DEVICE_DESC_LENGTH;
 
-    snprintf( dirpath, LIBUSB_PATH_MAX, "//?/unix/%s/%s/*", usb_path, bus->dirname );
+    /* These are as they came from the device, little endian */
+    if( usb_decode_device( desc, len, &dev->descriptor ) < 0 ) return;
 
-    hFind = FindFirstFileA( dirpath, &ffd );
+    if( dev->descriptor.bNumConfigurations > USB_MAXCONFIG || dev->descriptor.bNumConfigurations < 1 )
+	return;
 
-    if( hFind == INVALID_HANDLE_VALUE )
-	USB_ERROR_STR( -errno, "couldn't opendir(%s): %lX", dirpath, GetLastError() );
+    for( i = 0; i < dev->descriptor.bNumConfigurations; i++ )
+    {
+	struct usb_config_descriptor config;
 
-    do {
-	unsigned char device_desc[DEVICE_DESC_LENGTH];
-	char filename[LIBUSB_PATH_MAX + 1];
-	struct usb_device *dev;
-	struct usb_connectinfo connectinfo;
-	int i, fd, ret;
+	if( usb_decode_config_prefix( desc + offset, len - offset, &config ) < 0 ) break;
+	if( config.wTotalLength < CONFIG_DESC_LENGTH || offset + config.wTotalLength > len )
+	{
+	    if( usb_debug >= 1 ) fprintf( stderr, "Config descriptor too short (expected %d, got %d)\n",
+					  config.wTotalLength, len - offset );
+	    break;
+	}
+	configs[i] = desc + offset;
+	lengths[i] = config.wTotalLength;
+	offset += config.wTotalLength;
+    }
 
-	/* Skip anything starting with a . */
-	if( d_name[0] == '.' ) continue;
+    usb_parse_configurations( dev, configs, lengths, i );
+}
 
-	dev = malloc(sizeof(*dev));
-	if( !dev ) USB_ERROR( -ENOMEM );
+static int find_busses_scan( struct usb_bus **busses )
+{
+    const struct usb_scan_device *entry;
+    struct usb_bus *fbus = NULL, *bus;
 
-	memset((void *)dev, 0, sizeof(*dev));
+    for( entry = scan_next( NULL ); entry; entry = scan_next( entry ) )
+    {
+	char dirname[16];
 
-	dev->bus = bus;
+	snprintf( dirname, sizeof(dirname), "%03d", entry->busnum );
+	for( bus = fbus; bus; bus = bus->next )
+	    if( !strcmp( bus->dirname, dirname ) ) break;
+	if( bus ) continue;
 
-	lstrcpynA( dev->filename, d_name, sizeof(dev->filename) - 1 );
-	dev->filename[sizeof(dev->filename) - 1] = 0;
+	bus = malloc(sizeof(*bus));
+	if( !bus ) USB_ERROR( -ENOMEM );
 
-	snprintf( filename, sizeof(filename) - 1, "%s/%s/%s", usb_path, bus->dirname, d_name );
-	fd = x_open( filename, O_RDWR );
-	if( fd < 0 )
-	{
-	    fd = x_open( filename, O_RDONLY );
-	    if( fd < 0 )
-	    {
-		if( usb_debug >= 2 )
-		    fprintf( stderr, "usb_os_find_devices: Couldn't open %s\n", filename );
-		free(dev);
-		continue;
-	    }
-	}
+	memset((void *)bus, 0, sizeof(*bus));
+	strcpy( bus->dirname, dirname );
+	LIST_ADD( fbus, bus );
 
-	/* Get the device number */
-	ret = x_ioctl( fd, X_IOCTL_USB_CONNECTINFO, &connectinfo );
-	if( ret < 0 )
-	{
-	    if( usb_debug )
-		fprintf(stderr, "usb_os_find_devices: couldn't get connect info\n");
-	}
-	else
-	    dev->devnum = connectinfo.devnum;
+	if( usb_debug >= 2 ) fprintf(stderr, "usb_os_find_busses: Found %s\n", bus->dirname);
+    }
 
-	ret = x_read( fd, (void *)device_desc, DEVICE_DESC_LENGTH );
-	if( ret < 0 ) 
-	{
-	    if( usb_debug )
-		fprintf(stderr, "usb_os_find_devices: Couldn't read descriptor\n");
-	    free(dev);
-	    goto err;
-	}
+    *busses = fbus;
 
-	/*
-	 * Linux kernel converts the words in this descriptor to CPU endian, so
-	 * we use the undocumented W character for usb_parse_descriptor() that
-	 * doesn't convert endianess when parsing the descriptor
-	 */
-	usb_parse_descriptor( device_desc, "bbWbbbbWWWbbbb", &dev->descriptor );
+    return 0;
+}
 
-	LIST_ADD( fdev, dev );
+static int find_devices_scan( struct usb_bus *bus, struct usb_device **devices )
+{
+    const struct usb_scan_device *entry;
+    struct usb_device *fdev = NULL, *dev;
+    struct usb_index known;
+    int busnum = atoi( bus->dirname ), count = 0;
 
-	if( usb_debug >= 2 )
-	    fprintf( stderr, "usb_os_find_devices: Found %s on %s\n", dev->filename, bus->dirname );
+    for( dev = bus->devices; dev; dev = dev->next ) count++;
+    if( usb_index_init( &known, count ) < 0 ) USB_ERROR( -ENOMEM );
+    for( dev = bus->devices; dev; dev = dev->next ) usb_index_add( &known, dev->filename, dev );
 
-	/* Now try to fetch the rest of the descriptors */
-	if( dev->descriptor.bNumConfigurations > USB_MAXCONFIG )
-	    goto err; /* Silent since we'll try again later */
+    for( entry = scan_next( NULL ); entry; entry = scan_next( entry ) )
+    {
+	struct usb_device *known_dev;
 
-	if( dev->descriptor.bNumConfigurations < 1 )
-	    goto err; /* Silent since we'll try again later */
+	if( entry->busnum != busnum ) continue;
 
-	dev->config = malloc( dev->descriptor.bNumConfigurations * sizeof(struct usb_config_descriptor) );
-	if( !dev->config )
-	    goto err; /* Silent since we'll try again later */
+	dev = malloc(sizeof(*dev));
+	if( !dev )
+	{
+	    usb_index_free( &known );
+	    USB_ERROR( -ENOMEM );
+	}
 
-	memset( dev->config, 0, dev->descriptor.bNumConfigurations * sizeof(struct usb_config_descriptor) );
+	memset((void *)dev, 0, sizeof(*dev));
+	dev->bus = bus;
+	snprintf( dev->filename, sizeof(dev->filename), "%03d", entry->devnum );
 
-	for (i = 0; i < dev->descriptor.bNumConfigurations; i++)
+	if( ( known_dev = find_known_device( &known, dev->filename, entry->stamp ) ) ) make_stub( dev, known_dev );
+	else
 	{
-	    unsigned char buffer[8], *bigbuffer;
-	    struct usb_config_descriptor config;
-
-	    /* Get the first 8 bytes so we can figure out what the total length is */
-	    ret = x_read( fd, (void *)buffer, 8 );
-	    if( ret < 8 )
+	    if( set_stamp( dev, entry->stamp ) < 0 )
 	    {
-		if( usb_debug >= 1 )
-		{
-		    if( ret < 0 )
-			fprintf( stderr, "Unable to get descriptor (%d)\n", ret );
-		    else
-			fprintf( stderr, "Config descriptor too short (expected %d, got %d)\n", 8, ret );
-		}
-		goto err;
+		free(dev);
+		usb_index_free( &known );
+		USB_ERROR( -ENOMEM );
 	    }
+	    dev->devnum = entry->devnum;
+	    parse_descriptors( dev, (unsigned char *)(entry + 1), entry->desc_length );
 
-	    usb_parse_descriptor( buffer, "bbw", &config );
+	    if( usb_debug >= 2 )
+		fprintf( stderr, "usb_os_find_devices: Found %s on %s (%s)\n", dev->filename, bus->dirname, entry->port );
+	}
 
-	    bigbuffer = malloc( config.wTotalLength );
-	    if( !bigbuffer )
-	    {
-		if( usb_debug >= 1 )
-		    fprintf(stderr, "Unable to allocate memory for descriptors\n");
-		goto err;
-	    }
+	LIST_ADD( fdev, dev );
+    }
+    usb_index_free( &known );
 
-	    /* Read the rest of the config descriptor */
-	    memcpy( bigbuffer, buffer, 8 );
+    *devices = fdev;
 
-	    ret = x_read( fd, (void *)(bigbuffer + 8), config.wTotalLength - 8 );
-	    if( ret < config.wTotalLength - 8 )
-	    {
-		if( usb_debug >= 1 )
-		{
-		    if( ret < 0 )
-			fprintf( stderr, "Unable to get descriptor (%d)\n", ret );
-		    else
-			fprintf( stderr, "Config descriptor too short (expected %d, got %d)\n", config.wTotalLength, ret );
-		}
+    return 0;
+}
 
-		free(bigbuffer);
-		goto err;
-	    }
+int usb_os_find_busses( struct usb_bus **busses )
+{
+    int ret;
 
-	    ret = usb_parse_configuration( &dev->config[i], bigbuffer );
-	    if( usb_debug >= 2 )
-	    {
-		if( ret > 0 )
-		    fprintf(stderr, "Descriptor data still left\n");
-		else if( ret < 0 )
-		    fprintf(stderr, "Unable to parse descriptors\n");
-	    }
-	    free(bigbuffer);
-	}
-err:
-	x_close(fd);
+    if( !usb_path[0] ) USB_ERROR_STR( -ENOENT, "no USB VFS" );
+    if( ( ret = usb_scan() ) < 0 ) return ret;
 
-    } while( FindNextFileA( hFind, &ffd ) );
+    scan_fresh = 1;
+    return find_busses_scan( busses );
+}
 
-    FindClose( hFind );
+/* Stubs stand for a known device, so they match whatever they are compared with */
+int usb_os_same_device( struct usb_device *dev, struct usb_device *ndev )
+{
+    const struct linux_device *a = dev->dev, *b = ndev->dev;
 
-    *devices = fdev;
+    if( !a || !b ) return 1;
+    return !memcmp( a, b, sizeof(*a) );
+}
 
-    return 0;
+void usb_os_free_device( struct usb_device *dev )
+{
+    free( dev->dev );
+    dev->dev = NULL;
+}
+
+int usb_os_find_devices(struct usb_bus *bus, struct usb_device **devices)
+{
+    int ret;
+
+    /* usb_find_devices goes through the busses in order */
+    if( bus == usb_get_busses() && !scan_fresh && ( ret = usb_scan() ) < 0 ) return ret;
+    scan_fresh = 0;
+
+    return find_devices_scan( bus, devices );
 }
 
 int usb_os_determine_children(struct usb_bus *bus)
 {
+  const struct usb_scan_device *entry, *entries[256];
   struct usb_device *dev, *devices[256];
-  struct usb_ioctl command;
-  int ret, i, i1;
+  int busnum = atoi(bus->dirname), i, i1;
 
   /* Create a list of devices first */
   memset(devices, 0, sizeof(devices));
@@ -390,33 +418,25 @@ int usb_os_determine_children(struct usb_bus *bus)
     if (dev->devnum)
       devices[dev->devnum] = dev;
 
+  /* The scan has the children of every hub */
+  memset(entries, 0, sizeof(entries));
+  for (entry = scan_next(NULL); entry; entry = scan_next(entry))
+    if (entry->busnum == busnum && entry->devnum < 256)
+      entries[entry->devnum] = entry;
+
   /* Now fetch the children for each device */
   for (dev = bus->devices; dev; dev = dev->next) {
-    struct usb_hub_portinfo portinfo;
-    int fd;
+    const unsigned char *ports;
 
-    fd = device_open(dev);
-    if( fd < 0 ) continue;
+    entry = dev->devnum < 256 ? entries[dev->devnum] : NULL;
 
-    /* Query the hub driver for the children of this device */
-    if (dev->config && dev->config->interface && dev->config->interface->altsetting)
-      command.ifno = dev->config->interface->altsetting->bInterfaceNumber;
-    else
-      command.ifno = 0;
-    command.ioctl_code = X_IOCTL_USB_HUB_PORTINFO;
-    command.data = &portinfo;
-    ret = x_ioctl(fd, X_IOCTL_USB_IOCTL, &command);
-    if (ret < 0) {
-      /* errno == ENOSYS means the device probably wasn't a hub */
-      if (errno != ENOSYS && usb_debug > 1)
-        fprintf(stderr, "error obtaining child information: %s\n", strerror(errno));
-      x_close(fd);
+    if (!entry || !entry->numports)
       continue;
-    }
+    ports = (const unsigned char *)(entry + 1) + entry->desc_length;
 
     dev->num_children = 0;
-    for (i = 0; i < portinfo.numports; i++)
-      if (portinfo.port[i])
+    for (i = 0; i < entry->numports; i++)
+      if (ports[i])
         dev->num_children++;
 
     /* Free any old children first */
@@ -429,20 +449,17 @@ int usb_os_determine_children(struct usb_bus *bus)
                 (unsigned long)sizeof(struct usb_device *) * dev->num_children);
 
       dev->num_children = 0;
-      x_close(fd);
       continue;
     }
 
-    for (i = 0, i1 = 0; i < portinfo.numports; i++) {
-      if (!portinfo.port[i])
+    for (i = 0, i1 = 0; i < entry->numports; i++) {
+      if (!ports[i])
         continue;
 
-      dev->children[i1++] = devices[portinfo.port[i]];
+      dev->children[i1++] = devices[ports[i]];
 
-      devices[portinfo.port[i]] = NULL;
+      devices[ports[i]] = NULL;
     }
-
-    x_close(fd);
   }
 
   /*
@@ -486,8 +503,17 @@ static int check_usb_vfs( const char *dirname )
 
 void usb_os_init(void)
 {
+  struct prm_get_devfs_path p = { -1, usb_path, sizeof(usb_path) };
+
+  /* An emulated usbfs on the unix side wins over everything else */
+  WINE_UNIX_CALL( unix_get_devfs_path, &p );
+  if (p.ret < 0)
+    usb_path[0] = 0;
+  else if (usb_debug)
+    fprintf(stderr, "usb_os_init: using emulated USB VFS\n");
+
   /* Find the path to the virtual filesystem */
-  if (getenv("USB_DEVFS_PATH")) {
+  if (!usb_path[0] && getenv("USB_DEVFS_PATH")) {
     if (check_usb_vfs(getenv("USB_DEVFS_PATH"))) {
       lstrcpynA(usb_path, getenv("USB_DEVFS_PATH"), sizeof(usb_path) - 1);
       usb_path[sizeof(usb_path) - 1] = 0;
@@ -539,18 +565,198 @@ int usb_get_driver_np( usb_dev_handle *dev, int interface, char *name, unsigned
     return p.ret;
 }
 
+void *usb_alloc_buffer_np( usb_dev_handle *dev, int size )
+{
+    struct prm_usb_alloc_buffer p = { -1, dev->fd, size, NULL };
+    WINE_UNIX_CALL( unix_usb_alloc_buffer, &p );
+    if( p.ret < 0 )
+	USB_ERROR_STR( NULL, "could not allocate %d bytes of usbfs memory: %s", size, strerror(-p.ret) );
+    return p.buffer;
+}
+
+int usb_free_buffer_np( usb_dev_handle *dev, void *buffer )
+{
+    struct prm_usb_free_buffer p = { -1, dev->fd, buffer };
+    WINE_UNIX_CALL( unix_usb_free_buffer, &p );
+    return p.ret;
+}
+
+int usb_get_stats_np( usb_dev_handle *dev, struct usb_stats_np *stats, int reset )
+{
+    struct prm_usb_get_stats p = { -1, dev->fd, reset, (struct usbfs_stats *)stats };
+    WINE_UNIX_CALL( unix_usb_get_stats, &p );
+    if( p.ret < 0 )
+	USB_ERROR_STR( p.ret, "could not get transfer statistics: %s", strerror(-p.ret) );
+    return 0;
+}
+
+/*
+ * Hotplug notification: a thread of ours sits in the unix side's monitor
+ * and, after every device that came or went, sets the event and runs the
+ * callbacks. Both are set up on first use.
+ */
+#define USB_HOTPLUG_MAX_CALLBACKS 16
+
+struct hotplug_callback
+{
+    usb_hotplug_callback_np callback;
+    void *context;
+};
+
+static SRWLOCK hotplug_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE hotplug_done = CONDITION_VARIABLE_INIT;
+static HANDLE hotplug_event;
+static struct hotplug_callback hotplug_callbacks[USB_HOTPLUG_MAX_CALLBACKS];
+static struct hotplug_callback hotplug_calling;	/* the one running right now */
+static DWORD hotplug_thread_id;
+
+static DWORD WINAPI hotplug_thread( void *arg )
+{
+    struct prm_usb_hotplug_wait p = { -1, (UINT_PTR)arg, -1 };
+
+    AcquireSRWLockExclusive( &hotplug_lock );
+    hotplug_thread_id = GetCurrentThreadId();
+    ReleaseSRWLockExclusive( &hotplug_lock );
+
+    for( ;; )
+    {
+	int i;
+
+	p.timeout = -1;
+	WINE_UNIX_CALL( unix_usb_hotplug_wait, &p );
+	if( p.ret < 0 ) break;
+
+	if( usb_debug >= 2 ) fprintf( stderr, "usb hotplug: devices changed (%u)\n", p.generation );
+	SetEvent( hotplug_event );
+
+	/*
+	 * Called without the lock, they may well register or unregister.
+	 * hotplug_calling lets usb_hotplug_unregister_np() wait for the one
+	 * running, so a callback is never called once unregistered.
+	 */
+	AcquireSRWLockExclusive( &hotplug_lock );
+	for( i = 0; i < USB_HOTPLUG_MAX_CALLBACKS; i++ )
+	{
+	    if( !hotplug_callbacks[i].callback ) continue;
+	    hotplug_calling = hotplug_callbacks[i];
+	    ReleaseSRWLockExclusive( &hotplug_lock );
+	    hotplug_calling.callback( hotplug_calling.context );
+	    AcquireSRWLockExclusive( &hotplug_lock );
+	    hotplug_calling.callback = NULL;
+	    WakeAllConditionVariable( &hotplug_done );
+	}
+	ReleaseSRWLockExclusive( &hotplug_lock );
+    }
+
+    if( usb_debug >= 1 ) fprintf( stderr, "usb hotplug: monitor stopped: %s\n", strerror(-p.ret) );
+    return 0;
+}
+
+/* Called with hotplug_lock held exclusively */
+static int hotplug_start(void)
+{
+    struct prm_usb_hotplug_wait p = { -1, 0, 0 };
+    HANDLE thread;
+
+    if( hotplug_event ) return 0;
+
+    /* Doesn't wait, just tells whether there is a monitor and where it is */
+    WINE_UNIX_CALL( unix_usb_hotplug_wait, &p );
+    if( p.ret < 0 && p.ret != -ETIMEDOUT )
+	USB_ERROR_STR( p.ret, "no hotplug monitor: %s", strerror(-p.ret) );
+
+    if( !( hotplug_event = CreateEventA( NULL, FALSE, FALSE, NULL ) ) )
+	USB_ERROR_STR( -ENOMEM, "could not create the hotplug event" );
+    if( !( thread = CreateThread( NULL, 0, hotplug_thread, (void *)(UINT_PTR)p.generation, 0, NULL ) ) )
+    {
+	CloseHandle( hotplug_event );
+	hotplug_event = NULL;
+	USB_ERROR_STR( -ENOMEM, "could not start the hotplug thread" );
+    }
+    CloseHandle( thread );
+    return 0;
+}
+
+void *usb_hotplug_event_np(void)
+{
+    HANDLE event;
+
+    AcquireSRWLockExclusive( &hotplug_lock );
+    event = hotplug_start() < 0 ? NULL : hotplug_event;
+    ReleaseSRWLockExclusive( &hotplug_lock );
+    return event;
+}
+
+int usb_hotplug_register_np( usb_hotplug_callback_np callback, void *context )
+{
+    int i, ret;
+
+    if( !callback ) USB_ERROR( -EINVAL );
+
+    AcquireSRWLockExclusive( &hotplug_lock );
+    if( !( ret = hotplug_start() ) )
+    {
+	for( i = 0; i < USB_HOTPLUG_MAX_CALLBACKS; i++ )
+	    if( !hotplug_callbacks[i].callback ) break;
+	if( i < USB_HOTPLUG_MAX_CALLBACKS )
+	{
+	    hotplug_callbacks[i].callback = callback;
+	    hotplug_callbacks[i].context = context;
+	}
+	else ret = -ENOSPC;
+    }
+    ReleaseSRWLockExclusive( &hotplug_lock );
+
+    if( ret == -ENOSPC ) USB_ERROR_STR( ret, "too many hotplug callbacks" );
+    return ret;
+}
+
+int usb_hotplug_unregister_np( usb_hotplug_callback_np callback, void *context )
+{
+    int i, ret = -ENOENT;
+
+    AcquireSRWLockExclusive( &hotplug_lock );
+    for( i = 0; i < USB_HOTPLUG_MAX_CALLBACKS; i++ )
+	if( hotplug_callbacks[i].callback == callback && hotplug_callbacks[i].context == context )
+	{
+	    hotplug_callbacks[i].callback = NULL;
+	    ret = 0;
+	    break;
+	}
+    /* Unless it's unregistering itself, let a running callback finish */
+    if( !ret && GetCurrentThreadId() != hotplug_thread_id )
+	while( hotplug_calling.callback == callback && hotplug_calling.context == context )
+	    SleepConditionVariableSRW( &hotplug_done, &hotplug_lock, INFINITE, 0 );
+    ReleaseSRWLockExclusive( &hotplug_lock );
+
+    return ret;
+}
+
 // -------------------------------------------------------------------------------
 // this async functions added by some person who'd like to remain anonymous
 // It was necessary to make Aerodrums application run under wine.
 
+/* how long usb_cancel_async waits for the kernel to give back a discarded URB (ms) */
+#define USB_CANCEL_TIMEOUT 1000
+
 typedef struct {
 	usb_dev_handle *dev;
-	char *bytes;
-	int size;
-	struct usb_urb urb;
-	int reaped;
+	uint64_t urb;		/* unix side URB, allocated by the first submit */
+	int type;
+	unsigned char ep;
+	int pktsize;
+	struct usb_iso_packet_np *packets;	/* results of the last isochronous request */
+	int npackets;
 } usb_context_t;
 
+/* Run ops on unix side URBs of c's device, all in one unix call */
+static int _usb_urb_batch(usb_context_t *c, struct urb_op *ops, unsigned int count)
+{
+	struct prm_usb_urb_batch p = { -1, c->dev->fd, count, ops };
+	WINE_UNIX_CALL( unix_usb_urb_batch, &p );
+	return p.ret;
+}
+
 static int _usb_setup_async(usb_dev_handle *dev, void **context,
                             int urbtype,
                             unsigned char ep, int pktsize)
@@ -569,13 +775,9 @@ static int _usb_setup_async(usb_dev_handle *dev, void **context,
 	memset(*c, 0, sizeof(usb_context_t));
 
 	(*c)->dev = dev;
-	(*c)->urb.type = urbtype;
-	(*c)->urb.endpoint = ep;
-	(*c)->urb.flags = 0;
-	(*c)->urb.signr = 0;
-	(*c)->urb.actual_length = 0;
-	(*c)->urb.number_of_packets = 0;	/* don't do isochronous yet */
-	(*c)->urb.usercontext = NULL;
+	(*c)->type = urbtype;
+	(*c)->ep = ep;
+	(*c)->pktsize = pktsize;
 
 	return 0;
 }
@@ -585,58 +787,92 @@ int usb_bulk_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
 	return _usb_setup_async(dev, context, USB_URB_TYPE_BULK, ep, 0);
 }
 
+int usb_interrupt_setup_async(usb_dev_handle *dev, void **context, unsigned char ep)
+{
+	return _usb_setup_async(dev, context, USB_URB_TYPE_INTERRUPT, ep, 0);
+}
+
+int usb_isochronous_setup_async(usb_dev_handle *dev, void **context, unsigned char ep, int pktsize)
+{
+	if (pktsize <= 0)
+		USB_ERROR_STR(-EINVAL, "invalid isochronous packet size %d", pktsize);
+
+	return _usb_setup_async(dev, context, USB_URB_TYPE_ISO, ep, pktsize);
+}
+
 /* Reading and writing are the same except for the endpoint */
 int usb_submit_async(void *context, char *bytes, int size)
 {
-	int ret;
-
 	usb_context_t *c = context;
+	struct urb_op op;
+
+	memset(&op, 0, sizeof(op));
+	op.op = URB_OP_SUBMIT;
+	op.urb = c->urb;
+	op.type = c->type;
+	op.endpoint = c->ep;
+	op.buffer = (uintptr_t)bytes;
+	op.length = size;
+
+	if (c->type == USB_URB_TYPE_ISO) {
+		int n;
+
+		if (size <= 0)
+			USB_ERROR_STR(-EINVAL, "invalid isochronous request size %d", size);
+
+		n = (size + c->pktsize - 1) / c->pktsize;
+		if (n != c->npackets) {
+			struct usb_iso_packet_np *packets = realloc(c->packets, n * sizeof(*packets));
+
+			if (!packets)
+				USB_ERROR_STR(-ENOMEM, "memory allocation error: %s\n", strerror(errno));
+			c->packets = packets;
+			c->npackets = n;
+		}
+		memset(c->packets, 0, n * sizeof(*c->packets));
+		op.packet_size = c->pktsize;
+	}
 
-	c->urb.buffer = bytes;
-	c->urb.buffer_length = size;
-	c->urb.usercontext = c;
-	c->reaped = 0;
+	_usb_urb_batch(c, &op, 1);
+	c->urb = op.urb;
 
-	ret = x_ioctl(c->dev->fd, X_IOCTL_USB_SUBMITURB, &c->urb);
-	if (ret < 0) {
-		USB_ERROR_STR(-errno, "error submitting URB: %s", strerror(errno));
-		return ret;
-	}
+	if (op.ret < 0)
+		USB_ERROR_STR(op.ret, "error submitting URB: %s", strerror(-op.ret));
 
 	return 0;
 }
 
 static int _usb_reap_async(void *context, int timeout, int cancel)
 {
-	int rc;
-	usb_context_t *c = context, *b;
-	struct usb_urb *urb;
+	usb_context_t *c = context;
+	struct urb_op op;
 
-	if (c->reaped)
-		return c->urb.actual_length;
+	if (!c->urb)
+		USB_ERROR_STR(-EINVAL, "nothing submitted on this context");
 
-again:
-	rc = x_ioctl(c->dev->fd, X_IOCTL_USB_REAPURB, &urb);
-	if (rc < 0) {
-		fprintf(stderr, "error reaping URB: %s", strerror(errno));
-		return rc;
-	}
+	memset(&op, 0, sizeof(op));
+	op.op = URB_OP_REAP;
+	op.urb = c->urb;
+	op.timeout = timeout;
+	op.packets = (uintptr_t)c->packets;
+	op.packet_count = c->npackets;
 
-	b = urb->usercontext;
-	if (b != c) {
-		b->reaped = 1;
-		goto again;
+	/*
+	 * Other threads' completions reaped on the way are handled on the unix
+	 * side. Like libusb-win32 a timeout of 0 only checks and INFINITE (-1)
+	 * never gives up. A timed out URB is cancelled, except by
+	 * usb_reap_async_nocancel where it stays in flight to be reaped again.
+	 */
+	_usb_urb_batch(c, &op, 1);
+	if (op.ret == -ETIMEDOUT) {
+		if (cancel)
+			usb_cancel_async(context);
+		USB_ERROR_STR(op.ret, "reaping request timed out");
 	}
+	if (op.ret < 0)
+		fprintf(stderr, "error reaping URB: %s", strerror(-op.ret));
 
-#if 0
-	/* Not ready for usb_cancel_async */
-	if (cancel) {
-		usb_cancel_async(context);
-	}
-#else
-	(void)cancel;
-#endif
-	return urb->actual_length;
+	return op.ret;
 }
 
 int usb_reap_async(void *context, int timeout)
@@ -652,43 +888,35 @@ int usb_reap_async_nocancel(void *context, int timeout)
 
 int usb_cancel_async(void *context)
 {
-    int rc;
-    usb_context_t *c = context;
-
-    printf("%s()\n", __func__);
-    USB_ERROR_STR(-errno, "usb_cancel_async is not yet implemented: %s\n", strerror(errno));
-#if 0
-    /* NOTE that this function will cancel all pending URBs */
-    /* on the same endpoint as this particular context, or even */
-    /* all pending URBs for this particular device. */
-
-    if (!c)
-    {
-        USBERR0("invalid context\n");
-        return -EINVAL;
-    }
-
-    if (c->dev->impl_info == INVALID_HANDLE_VALUE)
-    {
-        USBERR0("device not open\n");
-        return -EINVAL;
-    }
-
-    _usb_cancel_io(c);
+	usb_context_t *c = context;
+	struct urb_op ops[2];
 
-    return 0;
-#endif
+	if (!c)
+		USB_ERROR_STR(-EINVAL, "invalid context");
 
-	rc = x_ioctl(c->dev->fd, X_IOCTL_USB_DISCARDURB, &c->urb);
-	if (rc < 0)
-		fprintf(stderr, "error discarding URB: %s", strerror(errno));
+	if (!c->urb)
+		return 0;
 
 	/*
-	* When the URB is unlinked, it gets moved to the completed list and
-	* then we need to reap it or else the next time we call this function,
-	* we'll get the previous completion and exit early
-	*/
-	x_ioctl(c->dev->fd, X_IOCTL_USB_REAPURB, &context);
+	 * Only this context's URBs are discarded; the kernel completes them
+	 * with -ENOENT almost at once, so they are reaped in the same call with
+	 * a short bound. Reaping also keeps the next usb_reap_async from seeing
+	 * the cancelled completion. URBs of other contexts stay in flight.
+	 */
+	memset(ops, 0, sizeof(ops));
+	ops[0].op = URB_OP_DISCARD;
+	ops[0].urb = c->urb;
+	ops[1].op = URB_OP_REAP;
+	ops[1].urb = c->urb;
+	ops[1].timeout = USB_CANCEL_TIMEOUT;
+	ops[1].packets = (uintptr_t)c->packets;
+	ops[1].packet_count = c->npackets;
+
+	_usb_urb_batch(c, ops, 2);
+	if (ops[0].ret < 0)
+		USB_ERROR_STR(ops[0].ret, "error discarding URB: %s", strerror(-ops[0].ret));
+	if (ops[1].ret < 0)
+		USB_ERROR_STR(ops[1].ret, "error reaping cancelled URB: %s", strerror(-ops[1].ret));
 
 	return 0;
 }
@@ -702,8 +930,32 @@ int usb_free_async(void **context)
 		return -EINVAL;
 	}
 
+	if ((*c)->urb) {
+		struct urb_op op;
+
+		memset(&op, 0, sizeof(op));
+		op.op = URB_OP_FREE;
+		op.urb = (*c)->urb;
+		_usb_urb_batch(*c, &op, 1);
+	}
+
+	free((*c)->packets);
 	free(*c);
 	*c = NULL;
 
 	return 0;
 }
+
+int usb_isochronous_get_packets_np(void *context, struct usb_iso_packet_np *packets, int count)
+{
+	usb_context_t *c = context;
+
+	if (!c || c->type != USB_URB_TYPE_ISO)
+		USB_ERROR_STR(-EINVAL, "not an isochronous context");
+
+	if (count > c->npackets)
+		count = c->npackets;
+	memcpy(packets, c->packets, count * sizeof(*packets));
+
+	return c->npackets;
+}
@@ -43,9 +43,19 @@ struct usb_getdriver {
 };
 
 #define USB_URB_DISABLE_SPD	1
+#define USB_URB_SHORT_NOT_OK	1
 #define USB_URB_ISO_ASAP	2
+#define USB_URB_BULK_CONTINUATION	4
 #define USB_URB_QUEUE_BULK	0x10
 
+/* USBDEVFS_GET_CAPABILITIES bits */
+#define USB_CAP_ZERO_PACKET		0x01
+#define USB_CAP_BULK_CONTINUATION	0x02
+#define USB_CAP_NO_PACKET_SIZE_LIM	0x04
+#define USB_CAP_BULK_SCATTER_GATHER	0x08
+#define USB_CAP_REAP_AFTER_DISCONNECT	0x10
+#define USB_CAP_MMAP			0x20
+
 #define USB_URB_TYPE_ISO	0
 #define USB_URB_TYPE_INTERRUPT	1
 #define USB_URB_TYPE_CONTROL	2
@@ -27,242 +27,1681 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <endian.h>
 
 #include "unixlib.h"
-#include "linux.h"
+#include "usbfs.h"
+#include "usbtrace.h"
+#include "usbpcap.h"
 
 static inline void *ULongToPtr(uint32_t ul)
 {
     return (void *)(uint64_t)ul;
 }
 
-#define IOCTL_USB_CONTROL	_IOWR('U', 0, struct usb_ctrltransfer)
-#define IOCTL_USB_BULK		_IOWR('U', 2, struct usb_bulktransfer)
-#define IOCTL_USB_RESETEP	_IOR('U', 3, unsigned int)
-#define IOCTL_USB_SETINTF	_IOR('U', 4, struct usb_setinterface)
-#define IOCTL_USB_SETCONFIG	_IOR('U', 5, unsigned int)
-#define IOCTL_USB_GETDRIVER	_IOW('U', 8, struct usb_getdriver)
-#define IOCTL_USB_SUBMITURB	_IOR('U', 10, struct usb_urb)
-#define IOCTL_USB_DISCARDURB	_IO('U', 11)
-#define IOCTL_USB_REAPURB	_IOW('U', 12, void *)
-#define IOCTL_USB_REAPURBNDELAY	_IOW('U', 13, void *)
-#define IOCTL_USB_CLAIMINTF	_IOR('U', 15, unsigned int)
-#define IOCTL_USB_RELEASEINTF	_IOR('U', 16, unsigned int)
-#define IOCTL_USB_CONNECTINFO	_IOW('U', 17, struct usb_connectinfo)
-#define IOCTL_USB_IOCTL         _IOWR('U', 18, struct usb_ioctl)
-#define IOCTL_USB_HUB_PORTINFO	_IOR('U', 19, struct usb_hub_portinfo)
-#define IOCTL_USB_RESET		_IO('U', 20)
-#define IOCTL_USB_CLEAR_HALT	_IOR('U', 21, unsigned int)
-#define IOCTL_USB_DISCONNECT	_IO('U', 22)
-#define IOCTL_USB_CONNECT	_IO('U', 23)
+#define ETRANSFER_TIMEDOUT 116
+
+static int kernel_open( const char *name, int flags )
+{
+    return open( name, flags );
+}
+
+static int kernel_ioctl( int fd, unsigned long request, void *arg )
+{
+    return ioctl( fd, request, arg );
+}
+
+/*
+ * The kernel's own uevents rather than udev's: they come first, and devtmpfs
+ * has made the device node by then, even if udev may not have set its
+ * permissions yet
+ */
+static int kernel_uevent_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd, size = 1 << 20;
+
+    if( ( fd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT ) ) < 0 ) return -errno;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if( bind( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 )
+    {
+	int err = errno;
+
+	close( fd );
+	return -err;
+    }
+    /* Plugging in a hub full of devices makes for a burst of them */
+    setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+    return fd;
+}
+
+static const struct usbfs_ops kernel_ops =
+{
+    kernel_open,
+    close,
+    read,
+    kernel_ioctl,
+    poll,
+    mmap,
+    munmap,
+    NULL,
+    "/sys/bus/usb/devices",
+    kernel_uevent_open,
+};
+
+/* The kernel, or the emulator when USB_EMULATOR names a device script */
+static const struct usbfs_ops *usbfs = &kernel_ops;
+static pthread_once_t usbfs_once = PTHREAD_ONCE_INIT;
+
+static void usbfs_init(void)
+{
+    const char *script = getenv( "USB_EMULATOR" );
+    const struct usbfs_ops *ops;
+
+    usbtrace_init();
+    usbpcap_init();
+
+    if( !script || !*script ) return;
+    if( ( ops = usbemu_init( script ) ) ) usbfs = ops;
+    else fprintf( stderr, "USB_EMULATOR: couldn't set up %s, using the kernel\n", script );
+}
+
+static int _usb_control_msg( int fd, int requesttype, int request, int value, int index, char *bytes, int size, int timeout)
+{
+    struct usb_ctrltransfer ctrl;
+    int ret;
+
+    ctrl.bRequestType = requesttype;
+    ctrl.bRequest     = request;
+    ctrl.wValue       = value;
+    ctrl.wIndex       = index;
+    ctrl.wLength      = size;
+    ctrl.data         = bytes;
+    ctrl.timeout      = timeout;
+
+    ret = usbfs->ioctl( fd, IOCTL_USB_CONTROL, &ctrl );
+    if( ret < 0 )
+    {
+	int err = errno;
+
+	fprintf( stderr, "control message error: %s\n", strerror( err ) );
+	errno = err;	/* for the statistics */
+    }
+
+    return ret;
+}
+
+static int _usb_detach_kernel_driver_np( int fd, int interface )
+{
+    struct usb_ioctl command;
+    int ret;
+
+    command.ifno = interface;
+    command.ioctl_code = IOCTL_USB_DISCONNECT;
+    command.data = NULL;
+
+    ret = usbfs->ioctl( fd, IOCTL_USB_IOCTL, &command );
+    if( ret < 0 ) fprintf( stderr, "could not detach kernel driver from interface %d: %s\n", interface, strerror( errno ) );
+
+    return ret;
+}
+
+static int _usb_get_driver_np( int fd, int interface, char *name, unsigned int namelen )
+{
+    struct usb_getdriver getdrv;
+    int ret;
+
+    getdrv.interface = interface;
+    ret = usbfs->ioctl( fd, IOCTL_USB_GETDRIVER, &getdrv );
+    if( ret < 0 )
+    {
+	fprintf( stderr, "could not get bound driver: %s", strerror( errno ) );
+	return ret;
+    }
+
+    strncpy( name, getdrv.driver, namelen - 1 );
+    name[namelen - 1] = 0;
+
+    return 0;
+}
+
+static int _usb_set_altinterface( int fd, int interface, int altsetting )
+{
+    int ret;
+    struct usb_setinterface setintf;
+
+    if( interface < 0 ) return -EINVAL;
+
+    setintf.interface = interface;
+    setintf.altsetting = altsetting;
+
+    ret = usbfs->ioctl( fd, IOCTL_USB_SETINTF, &setintf );
+    if( ret < 0 ) fprintf( stderr, "could not set alt intf %d/%d: %s", interface, altsetting, strerror( errno ) );
+
+    return ret;
+}
+
+#define MAX_URB_DEPTH		32
+#define DEFAULT_URB_DEPTH	4
+
+/* Number of bulk URBs kept in flight at once, USB_URB_DEPTH=1 submits them one by one */
+static int urb_depth(void)
+{
+    static int depth;
+
+    if( !depth )
+    {
+	const char *env = getenv( "USB_URB_DEPTH" );
+	int d = env ? atoi( env ) : DEFAULT_URB_DEPTH;
+
+	if( d < 1 ) d = 1;
+	if( d > MAX_URB_DEPTH ) d = MAX_URB_DEPTH;
+	depth = d;
+    }
+    return depth;
+}
+
+#define MAX_READ_WRITE		(16 * 1024)
+#define MAX_URB_SIZE		(1024 * 1024)
+
+/* Idle mmap'd buffers an fd keeps around for the next usb_alloc_buffer_np() */
+#define USBFS_POOL_MAX		(4 * 1024 * 1024)
+
+/* Buffer mmap'd from a usbfs fd, the kernel does DMA straight from/to it */
+struct usbfs_buffer
+{
+    struct usbfs_buffer *next;
+    void *addr;
+    size_t size;
+    int busy;
+};
+
+/*
+ * Completion of one URB. While the URB is in flight its usercontext points
+ * here, so whichever thread reaps it can mark it done and wake its owner.
+ */
+struct urb_completion
+{
+    struct urb_completion *next;	/* in the list of threads waiting on the device */
+    pthread_cond_t cond;
+    int done;
+    int ep;			/* for the statistics */
+    uint64_t submitted;		/* us */
+};
+
+/* State kept for every usbfs fd a transfer has been done on */
+struct usbfs_dev
+{
+    struct usbfs_dev *next;
+    int fd;
+    uint32_t caps;	/* USB_CAP_*, 0 if the kernel can't tell */
+    int urb_size;	/* bytes per bulk URB */
+    struct usbfs_buffer *pool;
+
+    /* completion dispatcher, see urb_wait_done() */
+    pthread_mutex_t lock;
+    int reaping;			/* a thread is reaping on fd */
+    struct urb_completion *waiters;	/* threads waiting for somebody else to reap */
+
+    struct usbfs_stats stats;		/* updated with relaxed atomics, see usbfs_stats_add() */
+};
+
+static pthread_mutex_t usbfs_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbfs_dev *usbfs_devs;
+
+static int usbfs_stats_interval;	/* USB_STATS, seconds between dumps */
+static pthread_once_t usbfs_stats_once = PTHREAD_ONCE_INIT;
+
+static uint64_t usbfs_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static struct usbfs_ep_stats *usbfs_ep_stats( struct usbfs_dev *dev, int ep )
+{
+    return &dev->stats.ep[( ep & 0x0f ) | ( ep & 0x80 ? 16 : 0 )];
+}
+
+/* Count n into field of the endpoint and the device total */
+#define usbfs_stats_add( dev, ep, field, n ) do { \
+    __atomic_fetch_add( &(dev)->stats.total.field, (n), __ATOMIC_RELAXED ); \
+    __atomic_fetch_add( &usbfs_ep_stats( (dev), (ep) )->field, (n), __ATOMIC_RELAXED ); \
+} while (0)
+
+static void usbfs_stats_latency( struct usbfs_dev *dev, int ep, uint64_t us )
+{
+    int i = 0;
+
+    while( i < USBFS_STATS_BUCKETS - 1 && us >= (uint64_t)USBFS_STATS_BUCKET0 << i ) i++;
+    usbfs_stats_add( dev, ep, latency[i], 1 );
+}
+
+/* Account a URB that came back with status after actual bytes */
+static void usbfs_stats_complete( struct usbfs_dev *dev, int ep, int status, int actual, uint64_t submitted )
+{
+    usbfs_stats_add( dev, ep, completions, 1 );
+    usbfs_stats_add( dev, ep, bytes, actual );
+    usbfs_stats_latency( dev, ep, usbfs_now_us() - submitted );
+
+    /* Unlinked URBs are counted as discards, short packets are no failure */
+    if( status == -EPIPE ) usbfs_stats_add( dev, ep, stalls, 1 );
+    else if( status < 0 && status != -ENOENT && status != -ECONNRESET && status != -EREMOTEIO )
+	usbfs_stats_add( dev, ep, errors, 1 );
+}
+
+/* Upper bound in us of the bucket the pct'th percentile of s falls into, 0 for none */
+static uint64_t usbfs_stats_percentile( const struct usbfs_ep_stats *s, int pct )
+{
+    uint64_t total = 0, seen = 0;
+    int i;
+
+    for( i = 0; i < USBFS_STATS_BUCKETS; i++ ) total += s->latency[i];
+    if( !total ) return 0;
+
+    for( i = 0; i < USBFS_STATS_BUCKETS - 1; i++ )
+	if( ( seen += s->latency[i] ) * 100 >= total * pct ) break;
+    return (uint64_t)USBFS_STATS_BUCKET0 << i;
+}
+
+static void usbfs_stats_print( const char *what, const struct usbfs_ep_stats *s )
+{
+    fprintf( stderr, "  %-8s urbs %llu bytes %llu done %u timeouts %u stalls %u errors %u discards %u foreign %u"
+	     " p50 <%lluus p99 <%lluus\n", what, (unsigned long long)s->urbs, (unsigned long long)s->bytes,
+	     s->completions, s->timeouts, s->stalls, s->errors, s->discards, s->foreign_reaps,
+	     (unsigned long long)usbfs_stats_percentile( s, 50 ), (unsigned long long)usbfs_stats_percentile( s, 99 ) );
+}
+
+/* Called with usbfs_devs_lock held */
+static void usbfs_stats_dump( struct usbfs_dev *dev )
+{
+    int i;
+
+    if( !dev->stats.total.urbs ) return;
+
+    fprintf( stderr, "usb stats fd %d:\n", dev->fd );
+    usbfs_stats_print( "total", &dev->stats.total );
+    for( i = 0; i < 32; i++ )
+    {
+	char name[16];
+
+	if( !dev->stats.ep[i].urbs ) continue;
+	snprintf( name, sizeof(name), "ep 0x%02x", ( i & 0x0f ) | ( i & 16 ? 0x80 : 0 ) );
+	usbfs_stats_print( name, &dev->stats.ep[i] );
+    }
+}
+
+static void *usbfs_stats_thread( void *arg )
+{
+    for( ;; )
+    {
+	struct usbfs_dev *dev;
+
+	sleep( usbfs_stats_interval );
+	pthread_mutex_lock( &usbfs_devs_lock );
+	for( dev = usbfs_devs; dev; dev = dev->next ) usbfs_stats_dump( dev );
+	pthread_mutex_unlock( &usbfs_devs_lock );
+    }
+    return NULL;
+}
+
+/* USB_STATS=<seconds> dumps the statistics of every open device that often, and at close */
+static void usbfs_stats_init(void)
+{
+    const char *env = getenv( "USB_STATS" );
+    pthread_t thread;
+
+    if( !env || ( usbfs_stats_interval = atoi( env ) ) <= 0 )
+    {
+	usbfs_stats_interval = 0;
+	return;
+    }
+    if( pthread_create( &thread, NULL, usbfs_stats_thread, NULL ) ) return;
+    pthread_detach( thread );
+}
+
+/* usbcore's limit on memory held by all usbfs URBs in the system, 0 for none */
+static int usbfs_memory_mb(void)
+{
+    static int mb = -1;
+
+    if( mb < 0 )
+    {
+	FILE *f = fopen( "/sys/module/usbcore/parameters/usbfs_memory_mb", "r" );
+	int val = 16;	/* kernel default */
+
+	if( f )
+	{
+	    if( fscanf( f, "%d", &val ) != 1 ) val = 16;
+	    fclose( f );
+	}
+	mb = val;
+    }
+    return mb;
+}
+
+/*
+ * Ask usbfs what it can do and pick the bulk URB size from it. Kernels that
+ * split bulk URBs into scatter-gather lists or don't limit the packet size
+ * take URBs up to MAX_URB_SIZE, as long as the window of URBs stays well
+ * inside usbfs_memory_mb. Anything older gets 16KB URBs like it always did.
+ */
+static void usbfs_dev_probe( struct usbfs_dev *dev )
+{
+    uint32_t caps;
+
+    dev->caps = 0;
+    dev->urb_size = MAX_READ_WRITE;
+
+    if( usbfs->ioctl( dev->fd, IOCTL_USB_GET_CAPABILITIES, &caps ) < 0 ) return;
+    dev->caps = caps;
+
+    if( caps & ( USB_CAP_BULK_SCATTER_GATHER | USB_CAP_NO_PACKET_SIZE_LIM ) )
+    {
+	int64_t budget = (int64_t)usbfs_memory_mb() * 1024 * 1024 / 4;
+	int64_t size = MAX_URB_SIZE;
+
+	if( budget && size > budget / urb_depth() ) size = budget / urb_depth();
+	size -= size % MAX_READ_WRITE;
+	if( size > MAX_READ_WRITE ) dev->urb_size = size;
+    }
+}
+
+/* Look up the state of fd, creating and probing it on first use */
+static struct usbfs_dev *usbfs_dev_get( int fd )
+{
+    struct usbfs_dev *dev;
+
+    pthread_once( &usbfs_stats_once, usbfs_stats_init );
+
+    pthread_mutex_lock( &usbfs_devs_lock );
+    for( dev = usbfs_devs; dev; dev = dev->next )
+	if( dev->fd == fd ) break;
+
+    if( !dev && ( dev = calloc( 1, sizeof(*dev) ) ) )
+    {
+	dev->fd = fd;
+	pthread_mutex_init( &dev->lock, NULL );
+	usbfs_dev_probe( dev );
+	dev->next = usbfs_devs;
+	usbfs_devs = dev;
+    }
+    pthread_mutex_unlock( &usbfs_devs_lock );
+
+    return dev;
+}
+
+static void usbfs_dev_remove( int fd )
+{
+    struct usbfs_dev **pdev, *dev;
+
+    pthread_mutex_lock( &usbfs_devs_lock );
+    for( pdev = &usbfs_devs; ( dev = *pdev ); pdev = &dev->next )
+    {
+	if( dev->fd != fd ) continue;
+	*pdev = dev->next;
+	if( usbfs_stats_interval ) usbfs_stats_dump( dev );
+	while( dev->pool )
+	{
+	    struct usbfs_buffer *buf = dev->pool;
+
+	    dev->pool = buf->next;
+	    usbfs->munmap( buf->addr, buf->size );
+	    free( buf );
+	}
+	pthread_mutex_destroy( &dev->lock );
+	free( dev );
+	break;
+    }
+    pthread_mutex_unlock( &usbfs_devs_lock );
+}
+
+/*
+ * Hand out a buffer mmap'd from the usbfs fd. URBs whose buffer lies in such
+ * a mapping are transferred without the kernel copying the data or pinning
+ * user pages. Freed buffers stay in a small per-fd pool for reuse, all of
+ * them are unmapped when the fd is closed.
+ */
+static int usbfs_alloc_buffer( int fd, unsigned int size, void **buffer )
+{
+    struct usbfs_dev *dev = usbfs_dev_get( fd );
+    struct usbfs_buffer *buf, *best = NULL;
+    size_t page = sysconf( _SC_PAGESIZE );
+    int ret = 0;
+
+    *buffer = NULL;
+    if( !dev ) return -ENOMEM;
+    if( !( dev->caps & USB_CAP_MMAP ) ) return -ENOSYS;
+    if( !size ) return -EINVAL;
+
+    size = ( size + page - 1 ) & ~( page - 1 );
+
+    pthread_mutex_lock( &usbfs_devs_lock );
+    for( buf = dev->pool; buf; buf = buf->next )
+	if( !buf->busy && buf->size >= size && ( !best || buf->size < best->size ) ) best = buf;
+
+    if( !best && ( best = calloc( 1, sizeof(*best) ) ) )
+    {
+	best->addr = usbfs->mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if( best->addr == MAP_FAILED )
+	{
+	    ret = -errno;
+	    fprintf( stderr, "could not mmap %u bytes of usbfs memory: %s\n", size, strerror(errno) );
+	    free( best );
+	    best = NULL;
+	}
+	else
+	{
+	    best->size = size;
+	    best->next = dev->pool;
+	    dev->pool = best;
+	}
+    }
+    else if( !best ) ret = -ENOMEM;
+
+    if( best )
+    {
+	best->busy = 1;
+	*buffer = best->addr;
+    }
+    pthread_mutex_unlock( &usbfs_devs_lock );
+
+    return ret;
+}
+
+static int usbfs_free_buffer( int fd, void *buffer )
+{
+    struct usbfs_dev *dev = usbfs_dev_get( fd );
+    struct usbfs_buffer **pbuf, *buf;
+    size_t idle = 0;
+    int ret = -EINVAL;
+
+    if( !dev ) return -EINVAL;
+
+    pthread_mutex_lock( &usbfs_devs_lock );
+    for( buf = dev->pool; buf; buf = buf->next )
+	if( !buf->busy ) idle += buf->size;
+
+    for( pbuf = &dev->pool; ( buf = *pbuf ); pbuf = &buf->next )
+    {
+	if( buf->addr != buffer || !buf->busy ) continue;
+
+	buf->busy = 0;
+	if( idle + buf->size > USBFS_POOL_MAX )
+	{
+	    *pbuf = buf->next;
+	    usbfs->munmap( buf->addr, buf->size );
+	    free( buf );
+	}
+	ret = 0;
+	break;
+    }
+    pthread_mutex_unlock( &usbfs_devs_lock );
+
+    return ret;
+}
+
+/* Set *deadline to timeout milliseconds from now on the monotonic clock */
+static void urb_deadline( struct timespec *deadline, int timeout )
+{
+    clock_gettime( CLOCK_MONOTONIC, deadline );
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long)(timeout % 1000) * 1000000;
+    if( deadline->tv_nsec >= 1000000000 )
+    {
+	deadline->tv_nsec -= 1000000000;
+	deadline->tv_sec++;
+    }
+}
+
+/* Milliseconds left until deadline, rounded up, 0 once it has passed */
+static int urb_remaining( const struct timespec *deadline )
+{
+    struct timespec now;
+    int64_t ns;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    ns = (int64_t)( deadline->tv_sec - now.tv_sec ) * 1000000000 + ( deadline->tv_nsec - now.tv_nsec );
+    if( ns <= 0 ) return 0;
+    return ns / 1000000 + ( ns % 1000000 ? 1 : 0 );
+}
+
+static void urb_init_completion( struct urb_completion *done )
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &done->cond, &attr );
+    pthread_condattr_destroy( &attr );
+    done->next = NULL;
+    done->done = 1;
+}
+
+static void urb_destroy_completion( struct urb_completion *done )
+{
+    pthread_cond_destroy( &done->cond );
+}
+
+/* Reap whatever has completed on dev, called as the reaping thread */
+static int urb_reap_completed( struct usbfs_dev *dev, struct urb_completion *mine )
+{
+    struct usb_urb *context;
+    int done = 0;
+
+    while( !done )
+    {
+	struct urb_completion *owner;
+
+	context = NULL;
+	if( usbfs->ioctl( dev->fd, IOCTL_USB_REAPURBNDELAY, &context ) < 0 )
+	{
+	    if( errno == EAGAIN ) return 0;
+	    fprintf( stderr, "error reaping URB: %s\n", strerror(errno) );
+	    return -errno;
+	}
+
+	USBTRACE( USBTRACE_REAP, dev->fd, context->endpoint, context->type, (uintptr_t)context,
+		  context->actual_length, context->status );
+	USBPCAP_URB( dev->fd, 'C', context, context->status );
+	if( ( owner = context->usercontext ) )
+	{
+	    /* owner can't go away before it's marked done */
+	    usbfs_stats_complete( dev, owner->ep, context->status, context->actual_length, owner->submitted );
+	    if( owner != mine ) usbfs_stats_add( dev, owner->ep, foreign_reaps, 1 );
+	}
+
+	pthread_mutex_lock( &dev->lock );
+	if( owner )
+	{
+	    owner->done = 1;
+	    pthread_cond_signal( &owner->cond );
+	}
+	done = mine->done;
+	pthread_mutex_unlock( &dev->lock );
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for the URB completing into done, until deadline or forever without
+ * one. The URB stays in flight when the wait times out.
+ *
+ * usbfs hands out completions in whatever order they come, so this works as
+ * a dispatcher: the first thread to wait becomes the reaper, sleeps in poll()
+ * (usbfs raises POLLOUT for completed URBs) and wakes up the owner of every
+ * URB it reaps directly. The others sleep on their own completion until it
+ * is marked done, or until the reaper leaves and hands its job over to them.
+ */
+static int urb_wait_done( struct usbfs_dev *dev, struct urb_completion *done, const struct timespec *deadline )
+{
+    struct urb_completion **pwait;
+    int ret = 0;
+
+    pthread_mutex_lock( &dev->lock );
+    while( !done->done && !ret )
+    {
+	if( dev->reaping )
+	{
+	    int rc;
+
+	    done->next = dev->waiters;
+	    dev->waiters = done;
+
+	    if( deadline ) rc = pthread_cond_timedwait( &done->cond, &dev->lock, deadline );
+	    else           rc = pthread_cond_wait( &done->cond, &dev->lock );
+
+	    for( pwait = &dev->waiters; *pwait; pwait = &(*pwait)->next )
+		if( *pwait == done )
+		{
+		    *pwait = done->next;
+		    break;
+		}
+
+	    if( rc == ETIMEDOUT && !done->done ) ret = -ETRANSFER_TIMEDOUT;
+	    continue;
+	}
+
+	dev->reaping = 1;
+	pthread_mutex_unlock( &dev->lock );
+
+	for( ;; )
+	{
+	    struct pollfd pfd;
+	    int ms = -1;
+
+	    if( ( ret = urb_reap_completed( dev, done ) ) || done->done ) break;
+
+	    if( deadline && !( ms = urb_remaining( deadline ) ) )
+	    {
+		ret = -ETRANSFER_TIMEDOUT;
+		break;
+	    }
+
+	    pfd.fd = dev->fd;
+	    pfd.events = POLLOUT;
+	    pfd.revents = 0;
+	    usbfs->poll( &pfd, 1, ms );
+	}
+
+	pthread_mutex_lock( &dev->lock );
+	dev->reaping = 0;
+    }
+
+    /* Let one of the others take over, we may have eaten the wakeup meant for that */
+    if( !dev->reaping && dev->waiters ) pthread_cond_signal( &dev->waiters->cond );
+    pthread_mutex_unlock( &dev->lock );
+
+    if( ret == -ETRANSFER_TIMEDOUT )
+    {
+	USBTRACE( USBTRACE_TIMEOUT, dev->fd, done->ep, 0, 0, 0, ret );
+	usbfs_stats_add( dev, done->ep, timeouts, 1 );
+    }
+
+    return ret;
+}
+
+/* usbfs takes at most this many packets in one isochronous URB */
+#define MAX_ISO_PACKETS		128
+
+/*
+ * Unix side URB for the async API, with the completion the usercontext points
+ * to. An isochronous request with more packets than one URB takes is a chain
+ * of them, each covering its own part of the buffer.
+ */
+struct usbfs_urb
+{
+    struct usbfs_urb *next;
+    int offset;			/* into the request's buffer */
+    int length;
+    int packet_size;		/* ISO, what the chain was laid out for */
+    struct urb_completion done;
+    struct usb_urb urb;		/* has to be last, ISO packet descriptors follow it */
+};
+
+static struct usbfs_urb *usbfs_urb_alloc( int packets )
+{
+    struct usbfs_urb *u;
+
+    if( !( u = calloc( 1, sizeof(*u) + packets * sizeof(struct usb_iso_packet_desc) ) ) ) return NULL;
+    urb_init_completion( &u->done );
+    return u;
+}
+
+static int usbfs_urb_iso_packets( const struct usbfs_urb *u )
+{
+    int packets = 0;
+
+    for( ; u; u = u->next ) packets += u->urb.number_of_packets;
+    return packets;
+}
+
+/* Spread length bytes over the packets of an ISO chain, packet_size each */
+static void usbfs_urb_layout_iso( struct usbfs_urb *head, int length, int packet_size )
+{
+    struct usbfs_urb *u;
+    int offset = 0, i;
+
+    for( u = head; u; u = u->next )
+    {
+	u->offset = offset;
+	u->packet_size = packet_size;
+	for( i = 0; i < u->urb.number_of_packets; i++ )
+	{
+	    int len = length - offset < packet_size ? length - offset : packet_size;
+
+	    u->urb.iso_frame_desc[i].length = len;
+	    u->urb.iso_frame_desc[i].actual_length = 0;
+	    u->urb.iso_frame_desc[i].status = 0;
+	    offset += len;
+	}
+	u->length = offset - u->offset;
+    }
+}
+
+/* Chain of ISO URBs for length bytes sent or received in packet_size packets */
+static struct usbfs_urb *usbfs_urb_alloc_iso( int length, int packet_size )
+{
+    struct usbfs_urb *head = NULL, **tail = &head;
+    int left;
+
+    if( packet_size <= 0 || length <= 0 ) return NULL;
+
+    for( left = ( length + packet_size - 1 ) / packet_size; left; )
+    {
+	int packets = left > MAX_ISO_PACKETS ? MAX_ISO_PACKETS : left;
+	struct usbfs_urb *u;
+
+	if( !( u = usbfs_urb_alloc( packets ) ) ) break;
+	u->urb.number_of_packets = packets;
+	left -= packets;
+
+	*tail = u;
+	tail = &u->next;
+    }
+
+    if( left )
+    {
+	while( head )
+	{
+	    struct usbfs_urb *next = head->next;
+
+	    urb_destroy_completion( &head->done );
+	    free( head );
+	    head = next;
+	}
+	return NULL;
+    }
+
+    usbfs_urb_layout_iso( head, length, packet_size );
+    return head;
+}
+
+/*
+ * Submit urb. A kernel that advertises big URBs can still fail to find the
+ * memory for one, in which case the URB is cut down to 16KB and this fd goes
+ * back to 16KB bulk URBs for good. The caller has to take the length back
+ * from urb->buffer_length.
+ */
+static int urb_submit( struct usbfs_dev *dev, struct usb_urb *urb, struct urb_completion *done )
+{
+    int ret;
+
+    urb->usercontext = done;
+    done->done = 0;
+    done->ep = urb->endpoint;
+    done->submitted = usbfs_now_us();
+
+    while( ( ret = usbfs->ioctl( dev->fd, IOCTL_USB_SUBMITURB, urb ) ) < 0 && errno == ENOMEM
+	   && urb->buffer_length > MAX_READ_WRITE )
+    {
+	dev->urb_size = MAX_READ_WRITE;
+	urb->buffer_length = MAX_READ_WRITE;
+    }
+
+    USBTRACE( USBTRACE_SUBMIT, dev->fd, urb->endpoint, urb->type, (uintptr_t)urb, urb->buffer_length, ret < 0 ? -errno : 0 );
+    USBPCAP_URB( dev->fd, ret < 0 ? 'E' : 'S', urb, ret < 0 ? -errno : 0 );
+    if( ret < 0 ) done->done = 1;
+    else usbfs_stats_add( dev, urb->endpoint, urbs, 1 );
+    return ret;
+}
+
+/* Unlink urb unless it has completed, it still has to be reaped */
+static int urb_discard( struct usbfs_dev *dev, struct usb_urb *urb, struct urb_completion *done )
+{
+    if( done->done ) return 0;
+
+    if( usbfs->ioctl( dev->fd, IOCTL_USB_DISCARDURB, urb ) < 0 )
+    {
+	/* EINVAL means it has completed in the meantime */
+	if( errno == EINVAL ) return 0;
+	USBTRACE( USBTRACE_DISCARD, dev->fd, urb->endpoint, urb->type, (uintptr_t)urb, 0, -errno );
+	fprintf( stderr, "error discarding URB: %s\n", strerror(errno) );
+	return -errno;
+    }
+    USBTRACE( USBTRACE_DISCARD, dev->fd, urb->endpoint, urb->type, (uintptr_t)urb, 0, 0 );
+    usbfs_stats_add( dev, urb->endpoint, discards, 1 );
+    return 0;
+}
+
+/* Unlink urb if it's still in flight and wait for it to come back */
+static void urb_cancel( struct usbfs_dev *dev, struct usb_urb *urb, struct urb_completion *done )
+{
+    urb_discard( dev, urb, done );
+
+    /*
+     * When the URB is unlinked, it gets moved to the completed list and the
+     * kernel writes it back when it's reaped, so it has to be reaped before
+     * the memory goes away
+     */
+    urb_wait_done( dev, done, NULL );
+}
+
+/* Free a chain of unix side URBs, reaping whatever is still in flight first */
+static void usbfs_urb_free( struct usbfs_dev *dev, struct usbfs_urb *u )
+{
+    while( u )
+    {
+	struct usbfs_urb *next = u->next;
+
+	urb_cancel( dev, &u->urb, &u->done );
+	urb_destroy_completion( &u->done );
+	free( u );
+	u = next;
+    }
+}
+
+/*
+ * Run a batch of operations on unix side URBs in one unix call. These back
+ * the async API: the URB has to be laid out for the 64-bit kernel, whatever
+ * the caller is, so the PE side only ever holds a handle to it.
+ */
+static int usbfs_urb_batch( int fd, struct urb_op *ops, unsigned int count )
+{
+    struct usbfs_dev *dev = usbfs_dev_get( fd );
+    unsigned int i;
+
+    /* Every op has to fail, the PE side only looks at their ret */
+    if( !dev )
+    {
+	for( i = 0; i < count; i++ ) ops[i].ret = -ENOMEM;
+	return -ENOMEM;
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+	struct urb_op *op = &ops[i];
+	struct usbfs_urb *u = (struct usbfs_urb *)(uintptr_t)op->urb, *next;
+
+	if( !u && op->op != URB_OP_SUBMIT )
+	{
+	    op->ret = -EINVAL;
+	    break;
+	}
+
+	switch( op->op )
+	{
+	    case URB_OP_SUBMIT:
+		if( op->type == USB_URB_TYPE_ISO && ( op->length <= 0 || op->packet_size <= 0 ) )
+		{
+		    op->ret = -EINVAL;
+		    break;
+		}
+
+		for( next = u; next; next = next->next )
+		    if( !next->done.done ) break;
+		if( next )
+		{
+		    op->ret = -EBUSY;
+		    break;
+		}
+
+		/*
+		 * ISO chains are cut to the size of each request. One with the
+		 * same number and size of packets is laid out again, anything
+		 * else gets a new chain.
+		 */
+		if( u && op->type == USB_URB_TYPE_ISO && u->urb.type == USB_URB_TYPE_ISO
+		    && u->packet_size == op->packet_size
+		    && usbfs_urb_iso_packets( u ) == ( op->length + op->packet_size - 1 ) / op->packet_size )
+		    usbfs_urb_layout_iso( u, op->length, op->packet_size );
+		else if( u && ( op->type == USB_URB_TYPE_ISO || u->urb.type == USB_URB_TYPE_ISO ) )
+		{
+		    usbfs_urb_free( dev, u );
+		    op->urb = 0;
+		    u = NULL;
+		}
+
+		if( !u )
+		{
+		    u = op->type == USB_URB_TYPE_ISO ? usbfs_urb_alloc_iso( op->length, op->packet_size )
+						     : usbfs_urb_alloc( 0 );
+		    if( !u )
+		    {
+			op->ret = -ENOMEM;
+			break;
+		    }
+		    op->urb = (uintptr_t)u;
+		}
+
+		if( op->type != USB_URB_TYPE_ISO ) u->length = op->length;
+
+		op->ret = 0;
+		for( next = u; next; next = next->next )
+		{
+		    next->urb.type = op->type;
+		    next->urb.endpoint = op->endpoint;
+		    next->urb.flags = op->type == USB_URB_TYPE_ISO ? USB_URB_ISO_ASAP : 0;
+		    next->urb.buffer = (char *)(uintptr_t)op->buffer + next->offset;
+		    next->urb.buffer_length = next->length;
+		    next->urb.status = 0;
+		    next->urb.actual_length = 0;
+		    next->urb.error_count = 0;
+
+		    if( urb_submit( dev, &next->urb, &next->done ) < 0 )
+		    {
+			struct usbfs_urb *prev;
+
+			op->ret = -errno;
+			fprintf( stderr, "error submitting URB: %s\n", strerror(errno) );
+			for( prev = u; prev != next; prev = prev->next )
+			    urb_cancel( dev, &prev->urb, &prev->done );
+			break;
+		    }
+		}
+		break;
+
+	    case URB_OP_REAP:
+	    {
+		struct usb_iso_packet_desc *packets = (struct usb_iso_packet_desc *)(uintptr_t)op->packets;
+		struct timespec deadline;
+		int total = 0, n = 0, j;
+
+		if( op->timeout >= 0 ) urb_deadline( &deadline, op->timeout );
+
+		for( next = u; next; next = next->next )
+		{
+		    op->ret = urb_wait_done( dev, &next->done, op->timeout >= 0 ? &deadline : NULL );
+		    if( op->ret ) break;
+
+		    total += next->urb.actual_length;
+		    for( j = 0; j < next->urb.number_of_packets && packets && n < op->packet_count; j++ )
+			packets[n++] = next->urb.iso_frame_desc[j];
+		}
+		if( !op->ret ) op->ret = total;
+		break;
+	    }
+
+	    case URB_OP_DISCARD:
+		op->ret = 0;
+		for( next = u; next; next = next->next )
+		{
+		    int ret = urb_discard( dev, &next->urb, &next->done );
+
+		    if( ret < 0 ) op->ret = ret;
+		}
+		break;
+
+	    case URB_OP_FREE:
+		usbfs_urb_free( dev, u );
+		op->urb = 0;
+		op->ret = 0;
+		break;
+
+	    default:
+		op->ret = -EINVAL;
+		break;
+	}
+
+	if( op->ret < 0 ) break;
+    }
+
+    return i;
+}
+
+/*
+ * Bulk transfer split into dev->urb_size sized URBs with up to depth of them
+ * in flight at once, so the bus doesn't sit idle while we reap and resubmit.
+ * IN URBs are queued with SHORT_NOT_OK and BULK_CONTINUATION: a short packet
+ * makes the kernel cancel the rest of the queue, so data belonging to the
+ * next transfer never lands in this one.
+ */
+static int _usb_bulk_transfer( struct usbfs_dev *dev, int ep, char *bytes, int size, int timeout, int depth )
+{
+    struct usb_urb urbs[MAX_URB_DEPTH];
+    struct urb_completion done[MAX_URB_DEPTH];
+    struct timespec deadline;
+    int head = 0, count = 0, submitted = 0, bytesdone = 0, stop = 0, rc = 0, submit_err = 0;
+    int i;
+
+    urb_deadline( &deadline, timeout );
+    for( i = 0; i < depth; i++ ) urb_init_completion( &done[i] );
+
+    for( ;; )
+    {
+	struct usb_urb *urb;
+
+	/* Keep the window full */
+	while( !stop && count < depth && submitted < size )
+	{
+	    int slot = (head + count) % depth;
+
+	    urb = &urbs[slot];
+	    memset( urb, 0, sizeof(*urb) );
+	    urb->type = USB_URB_TYPE_BULK;
+	    urb->endpoint = ep;
+	    if( ep & 0x80 )
+		urb->flags = USB_URB_SHORT_NOT_OK | ( submitted ? USB_URB_BULK_CONTINUATION : 0 );
+	    urb->buffer = bytes + submitted;
+	    urb->buffer_length = size - submitted;
+	    if( urb->buffer_length > dev->urb_size ) urb->buffer_length = dev->urb_size;
+
+	    if( urb_submit( dev, urb, &done[slot] ) < 0 )
+	    {
+		fprintf( stderr, "error submitting URB ep %s(%d): %s\n", ep & 0x80 ? "IN" : "OUT", ep & 0x7F, strerror(errno) );
+		submit_err = -1;
+		stop = 1;
+		break;
+	    }
+
+	    submitted += urb->buffer_length;
+	    count++;
+	}
+
+	if( !count ) break;
+
+	/* Completions come back in order on one endpoint, so wait for the oldest */
+	if( ( rc = urb_wait_done( dev, &done[head], timeout ? &deadline : NULL ) ) ) break;
+
+	/* A short or failed URB ends the transfer */
+	urb = &urbs[head];
+	bytesdone += urb->actual_length;
+	if( urb->actual_length != urb->buffer_length ) stop = 1;
+
+	head = (head + 1) % depth;
+	count--;
+
+	if( stop ) break;
+    }
+
+    /* Whatever is still in flight has to come back before urbs goes out of scope */
+    for( i = 0; i < count; i++ )
+    {
+	int slot = (head + i) % depth;
+
+	urb_discard( dev, &urbs[slot], &done[slot] );
+    }
+    for( i = 0; i < count; i++ )
+	urb_wait_done( dev, &done[(head + i) % depth], NULL );
+
+    for( i = 0; i < depth; i++ ) urb_destroy_completion( &done[i] );
+
+    /* A failed submit fails the transfer even if the URBs before it made it */
+    if( rc ) return rc;
+    return submit_err ? submit_err : bytesdone;
+}
+
+/* Reading and writing are the same except for the endpoint */
+static int _usb_urb_transfer( int fd, int ep, int urbtype, char *bytes, int size, int timeout )
+{
+    struct usbfs_dev *dev = usbfs_dev_get( fd );
+    struct urb_completion done;
+    struct usb_urb urb;
+    int bytesdone = 0, requested;
+    struct timespec deadline;
+    int ret = 0;
+
+    if( !dev ) return -ENOMEM;
+
+    /*
+     * Without BULK_CONTINUATION a short packet can't stop the URBs queued
+     * behind it, so IN transfers only get pipelined where usbfs has it.
+     */
+    if( urbtype == USB_URB_TYPE_BULK && size > dev->urb_size && urb_depth() > 1
+	&& ( !( ep & 0x80 ) || ( dev->caps & USB_CAP_BULK_CONTINUATION ) ) )
+	return _usb_bulk_transfer( dev, ep, bytes, size, timeout, urb_depth() );
+
+    /*
+     * Get actual time, and add the timeout value. The result is the absolute
+     * time where we have to quit waiting for an message.
+     */
+    urb_deadline( &deadline, timeout );
+    urb_init_completion( &done );
+
+    do {
+	int urb_size = urbtype == USB_URB_TYPE_BULK ? dev->urb_size : MAX_READ_WRITE;
+
+	requested = size - bytesdone;
+	if( requested > urb_size ) requested = urb_size;
+
+	urb.type = urbtype;
+	urb.endpoint = ep;
+	urb.flags = 0;
+	urb.buffer = bytes + bytesdone;
+	urb.buffer_length = requested;
+	urb.signr = 0;
+	urb.actual_length = 0;
+	urb.number_of_packets = 0;	/* don't do isochronous yet */
+
+	ret = urb_submit( dev, &urb, &done );
+	if( ret < 0 )
+	{
+	    fprintf( stderr, "error submitting URB ep %s(%d): %s\n", ep & 0x80 ? "IN" : "OUT", ep & 0x7F, strerror(errno) );
+	    break;
+	}
+	requested = urb.buffer_length;
 
-#define ETRANSFER_TIMEDOUT 116
+	if( ( ret = urb_wait_done( dev, &done, timeout ? &deadline : NULL ) ) ) break;
 
-static int _usb_control_msg( int fd, int requesttype, int request, int value, int index, char *bytes, int size, int timeout)
-{
-    struct usb_ctrltransfer ctrl;
-    int ret;
+	bytesdone += urb.actual_length;
 
-    ctrl.bRequestType = requesttype;
-    ctrl.bRequest     = request;
-    ctrl.wValue       = value;
-    ctrl.wIndex       = index;
-    ctrl.wLength      = size;
-    ctrl.data         = bytes;
-    ctrl.timeout      = timeout;
+    } while( bytesdone < size && urb.actual_length == requested );
+
+    /* If the URB didn't complete in success or error, then let's unlink it */
+    if( ret < 0 && !done.done ) urb_cancel( dev, &urb, &done );
+
+    urb_destroy_completion( &done );
 
-    ret = ioctl( fd, IOCTL_USB_CONTROL, &ctrl );
-    if( ret < 0 ) fprintf( stderr, "control message error: %s\n", strerror( errno ) );
+    return ret < 0 ? ret : bytesdone;
+}
+
+/* Control transfer on the default pipe, counted as endpoint 0 of its direction */
+static int usbfs_control_msg( int fd, int requesttype, int request, int value, int index, char *bytes, int size, int timeout )
+{
+    struct usbfs_dev *dev = usbfs_dev_get( fd );
+    int ep = requesttype & 0x80;
+    uint64_t submitted = usbfs_now_us();
+    uint64_t setup = (uint8_t)requesttype | (uint64_t)(uint8_t)request << 8 | (uint64_t)(uint16_t)value << 16 |
+		     (uint64_t)(uint16_t)index << 32 | (uint64_t)(uint16_t)size << 48;
+    int ret, err;
+
+    USBTRACE( USBTRACE_CONTROL_SUBMIT, fd, ep, USB_URB_TYPE_CONTROL, setup, size, 0 );
+    USBPCAP_CONTROL( fd, 'S', (uintptr_t)&setup, (const uint8_t *)&setup, bytes, size, 0 );
+    ret = _usb_control_msg( fd, requesttype, request, value, index, bytes, size, timeout );
+    /* Tracing and pcap may well change errno */
+    err = ret < 0 ? errno : 0;
+    USBTRACE( USBTRACE_CONTROL_DONE, fd, ep, USB_URB_TYPE_CONTROL, setup, ret < 0 ? 0 : ret, -err );
+    USBPCAP_CONTROL( fd, 'C', (uintptr_t)&setup, (const uint8_t *)&setup, bytes, ret, -err );
+    if( !dev ) return ret;
+
+    usbfs_stats_add( dev, ep, urbs, 1 );
+    if( err == ETIMEDOUT ) usbfs_stats_add( dev, ep, timeouts, 1 );
+    else usbfs_stats_complete( dev, ep, -err, ret < 0 ? 0 : ret, submitted );
 
     return ret;
 }
 
-static int _usb_detach_kernel_driver_np( int fd, int interface )
+static int usbfs_get_stats( int fd, struct usbfs_stats *stats, int reset )
 {
-    struct usb_ioctl command;
-    int ret;
+    struct usbfs_dev *dev = usbfs_dev_get( fd );
 
-    command.ifno = interface;
-    command.ioctl_code = IOCTL_USB_DISCONNECT;
-    command.data = NULL;
+    if( !dev ) return -ENOMEM;
 
-    ret = ioctl( fd, IOCTL_USB_IOCTL, &command );
-    if( ret < 0 ) fprintf( stderr, "could not detach kernel driver from interface %d: %s\n", interface, strerror( errno ) );
+    /* Counters moving while they are copied don't matter here */
+    pthread_mutex_lock( &usbfs_devs_lock );
+    if( stats ) memcpy( stats, &dev->stats, sizeof(*stats) );
+    if( reset ) memset( &dev->stats, 0, sizeof(dev->stats) );
+    pthread_mutex_unlock( &usbfs_devs_lock );
 
-    return ret;
+    return 0;
 }
 
-static int _usb_get_driver_np( int fd, int interface, char *name, unsigned int namelen )
+/* Everything left to read from fd into a malloc'd buffer */
+static int read_all( int fd, ssize_t (*readfn)( int, void *, size_t ), unsigned char **data )
 {
-    struct usb_getdriver getdrv;
-    int ret;
+    unsigned char *buf = NULL, *tmp;
+    size_t size = 0, len = 0;
+    ssize_t ret;
+
+    do
+    {
+	if( len == size )
+	{
+	    size = size ? size * 2 : 256;
+	    if( !( tmp = realloc( buf, size ) ) )
+	    {
+		free( buf );
+		return -ENOMEM;
+	    }
+	    buf = tmp;
+	}
+	ret = readfn( fd, buf + len, size - len );
+	if( ret > 0 ) len += ret;
+    } while( ret > 0 || ( ret < 0 && errno == EINTR ) );
 
-    getdrv.interface = interface;
-    ret = ioctl( fd, IOCTL_USB_GETDRIVER, &getdrv );
     if( ret < 0 )
     {
-	fprintf( stderr, "could not get bound driver: %s", strerror( errno ) );
-	return ret;
+	int err = errno;
+
+	free( buf );
+	return -err;
     }
+    *data = buf;
+    return len;
+}
 
-    strncpy( name, getdrv.driver, namelen - 1 );
-    name[namelen - 1] = 0;
+/* Whole file name under the directory dirfd into a malloc'd buffer */
+static int sysfs_read( int dirfd, const char *name, unsigned char **data )
+{
+    int fd, ret;
 
-    return 0;
+    if( ( fd = openat( dirfd, name, O_RDONLY | O_CLOEXEC ) ) < 0 ) return -errno;
+    ret = read_all( fd, read, data );
+    close( fd );
+    return ret;
 }
 
-static int _usb_set_altinterface( int fd, int interface, int altsetting )
+static int sysfs_read_int( int dirfd, const char *name )
 {
-    int ret;
-    struct usb_setinterface setintf;
+    unsigned char *data;
+    int len, val;
+
+    if( ( len = sysfs_read( dirfd, name, &data ) ) < 0 ) return len;
+    data[len < 255 ? len : 255] = 0;
+    val = atoi( (char *)data );
+    free( data );
+    return val;
+}
 
-    if( interface < 0 ) return -EINVAL;
+/*
+ * Hotplug monitor: a thread reading uevents, which counts up the generation
+ * whenever a USB device is added or removed. As long as it stays the same
+ * the last scan is still good, and waiters on hotplug_cond learn about
+ * changes without scanning at all.
+ */
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond;
+static unsigned int hotplug_generation;	/* 0 while there is no monitor */
+static pthread_once_t hotplug_once = PTHREAD_ONCE_INIT;
+static int hotplug_fd = -1;
 
-    setintf.interface = interface;
-    setintf.altsetting = altsetting;
+static void hotplug_changed(void)
+{
+    pthread_mutex_lock( &hotplug_lock );
+    if( hotplug_generation && !++hotplug_generation ) hotplug_generation = 1;
+    pthread_cond_broadcast( &hotplug_cond );
+    pthread_mutex_unlock( &hotplug_lock );
+}
 
-    ret = ioctl( fd, IOCTL_USB_SETINTF, &setintf );
-    if( ret < 0 ) fprintf( stderr, "could not set alt intf %d/%d: %s", interface, altsetting, strerror( errno ) );
+/* A USB device, not one of its interfaces, came or went */
+static int uevent_usb_device( const char *msg, size_t len )
+{
+    const char *p, *end = msg + len;
+    int action = 0, subsystem = 0, devtype = 0;
 
-    return ret;
+    if( !memchr( msg, '@', strnlen( msg, len ) ) ) return 0;
+    for( p = msg + strlen( msg ) + 1; p < end; p += strlen( p ) + 1 )
+    {
+	if( !strcmp( p, "ACTION=add" ) || !strcmp( p, "ACTION=remove" ) ) action = 1;
+	else if( !strcmp( p, "SUBSYSTEM=usb" ) ) subsystem = 1;
+	else if( !strcmp( p, "DEVTYPE=usb_device" ) ) devtype = 1;
+    }
+    return action && subsystem && devtype;
 }
 
-#define MAX_READ_WRITE		(16 * 1024)
-#define URB_USERCONTEXT_COOKIE	((void *)0x1)
-
-/* Reading and writing are the same except for the endpoint */
-static int _usb_urb_transfer( int fd, int ep, int urbtype, char *bytes, int size, int timeout )
+static void *hotplug_thread( void *arg )
 {
-    struct usb_urb urb;
-    int bytesdone = 0, requested;
-    struct timeval tv, tv_ref, tv_now;
-    struct usb_urb *context;
-    int ret, waiting;
+    char msg[8192];
 
-    /*
-     * HACK: The use of urb.usercontext is a hack to get threaded applications
-     * sort of working again. Threaded support is still not recommended, but
-     * this should allow applications to work in the common cases. Basically,
-     * if we get the completion for an URB we're not waiting for, then we update
-     * the usercontext pointer to 1 for the other threads URB and it will see
-     * the change after it wakes up from the the timeout. Ugly, but it works.
-     */
+    for( ;; )
+    {
+	struct sockaddr_nl from;
+	socklen_t fromlen = sizeof(from);
+	ssize_t len;
 
-    /*
-     * Get actual time, and add the timeout value. The result is the absolute
-     * time where we have to quit waiting for an message.
-     */
+	memset( &from, 0, sizeof(from) );
+	if( ( len = recvfrom( hotplug_fd, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&from, &fromlen ) ) < 0 )
+	{
+	    if( errno == EINTR ) continue;
+	    /* Events got lost, any device may have come or gone */
+	    if( errno == ENOBUFS )
+	    {
+		hotplug_changed();
+		continue;
+	    }
+	    fprintf( stderr, "usb hotplug monitor: %s\n", strerror(errno) );
+	    break;
+	}
+	/* Only the kernel sends on the netlink group, the emulator's socket pair has no sender */
+	if( from.nl_family == AF_NETLINK && from.nl_pid ) continue;
+
+	msg[len] = 0;
+	if( uevent_usb_device( msg, len ) ) hotplug_changed();
+    }
 
-    gettimeofday( &tv_ref, NULL );
-    tv_ref.tv_sec = tv_ref.tv_sec + timeout / 1000;
-    tv_ref.tv_usec = tv_ref.tv_usec + (timeout % 1000) * 1000;
+    pthread_mutex_lock( &hotplug_lock );
+    hotplug_generation = 0;
+    pthread_cond_broadcast( &hotplug_cond );
+    pthread_mutex_unlock( &hotplug_lock );
+    return NULL;
+}
+
+static void hotplug_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &hotplug_cond, &attr );
+    pthread_condattr_destroy( &attr );
 
-    if( tv_ref.tv_usec > 1000000 )
+    if( !usbfs->uevent_open || ( hotplug_fd = usbfs->uevent_open() ) < 0 ) return;
+
+    /* Before the thread runs, so that a change right away already counts */
+    hotplug_generation = 1;
+    if( pthread_create( &thread, NULL, hotplug_thread, NULL ) )
     {
-	tv_ref.tv_usec -= 1000000;
-	tv_ref.tv_sec++;
+	hotplug_generation = 0;
+	close( hotplug_fd );
+	hotplug_fd = -1;
+	return;
     }
+    pthread_detach( thread );
+}
 
-    do {
-	fd_set writefds;
+static unsigned int usbfs_hotplug_generation(void)
+{
+    unsigned int generation;
 
-	requested = size - bytesdone;
-	if( requested > MAX_READ_WRITE ) requested = MAX_READ_WRITE;
+    pthread_once( &usbfs_once, usbfs_init );
+    pthread_once( &hotplug_once, hotplug_init );
 
-	urb.type = urbtype;
-	urb.endpoint = ep;
-	urb.flags = 0;
-	urb.buffer = bytes + bytesdone;
-	urb.buffer_length = requested;
-	urb.signr = 0;
-	urb.actual_length = 0;
-	urb.number_of_packets = 0;	/* don't do isochronous yet */
-	urb.usercontext = NULL;
+    pthread_mutex_lock( &hotplug_lock );
+    generation = hotplug_generation;
+    pthread_mutex_unlock( &hotplug_lock );
+    return generation;
+}
 
-	ret = ioctl( fd, IOCTL_USB_SUBMITURB, &urb );
-	if( ret < 0 )
+/*
+ * Wait up to timeout ms, -1 for ever, for the generation to move on from
+ * *generation and store the new one
+ */
+static int usbfs_hotplug_wait( unsigned int *generation, int timeout )
+{
+    struct timespec until;
+    int ret = 0;
+
+    if( !usbfs_hotplug_generation() ) return -ENODEV;
+
+    if( timeout > 0 )
+    {
+	clock_gettime( CLOCK_MONOTONIC, &until );
+	until.tv_sec += timeout / 1000;
+	until.tv_nsec += ( timeout % 1000 ) * 1000000;
+	if( until.tv_nsec >= 1000000000 )
 	{
-	    fprintf( stderr, "error submitting URB ep %s(%d): %s\n", ep & 0x80 ? "IN" : "OUT", ep & 0x7F, strerror(errno) );
-	    return ret;
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
 	}
+    }
 
-	FD_ZERO( &writefds );
-	FD_SET( fd, &writefds );
+    pthread_mutex_lock( &hotplug_lock );
+    while( hotplug_generation && hotplug_generation == *generation && !ret )
+    {
+	if( !timeout ) ret = -ETRANSFER_TIMEDOUT;
+	else if( timeout < 0 ) pthread_cond_wait( &hotplug_cond, &hotplug_lock );
+	else if( pthread_cond_timedwait( &hotplug_cond, &hotplug_lock, &until ) ) ret = -ETRANSFER_TIMEDOUT;
+    }
+    if( !hotplug_generation ) ret = -ENODEV;
+    else if( hotplug_generation != *generation ) ret = 0;
+    *generation = hotplug_generation;
+    pthread_mutex_unlock( &hotplug_lock );
 
-restart:
-	waiting = 1;
-	context = NULL;
-	while( !urb.usercontext && ( ( ret = ioctl( fd, IOCTL_USB_REAPURBNDELAY, &context ) ) == -1 ) && waiting )
+    return ret;
+}
+
+#define USBFS_DT_DEVICE_SIZE	18
+#define USBFS_DT_INTERFACE	0x04
+#define USBFS_CLASS_HUB		9
+
+/* Append a device to the scan in buffer, if there is still room for it */
+static void scan_add( void *buffer, unsigned int size, unsigned int *used, struct usb_scan_device *entry,
+		      const unsigned char *desc, const unsigned char *ports )
+{
+    entry->size = ( sizeof(*entry) + entry->desc_length + entry->numports + 7 ) & ~7;
+    if( *used + entry->size <= size )
+    {
+	char *p = (char *)buffer + *used;
+
+	memcpy( p, entry, sizeof(*entry) );
+	memcpy( p + sizeof(*entry), desc, entry->desc_length );
+	memcpy( p + sizeof(*entry) + entry->desc_length, ports, entry->numports );
+    }
+    *used += entry->size;
+}
+
+static void scan_stamp( struct usb_scan_device *entry, const struct stat *st )
+{
+    entry->stamp[0] = st->st_ino;
+    entry->stamp[1] = (uint64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static int usbfs_open_node( const char *name )
+{
+    int fd = usbfs->open( name, O_RDWR | O_CLOEXEC );
+
+    if( fd < 0 ) fd = usbfs->open( name, O_RDONLY | O_CLOEXEC );
+    return fd;
+}
+
+/* The devices on the ports of the hub behind fd by devnum, 0 for empty ports */
+static int usbfs_hub_ports( int fd, const unsigned char *desc, int len, unsigned char *ports )
+{
+    struct usb_hub_portinfo portinfo;
+    struct usb_ioctl command;
+    int i;
+
+    /* The hub driver sits on the first interface */
+    command.ifno = 0;
+    for( i = USBFS_DT_DEVICE_SIZE; i + 3 <= len && desc[i] >= 2; i += desc[i] )
+	if( desc[i + 1] == USBFS_DT_INTERFACE )
 	{
-	    tv.tv_sec = 0;
-	    tv.tv_usec = 1000; // 1 msec
-	    select( fd + 1, NULL, &writefds, NULL, &tv); //sub second wait
+	    command.ifno = desc[i + 2];
+	    break;
+	}
+    command.ioctl_code = IOCTL_USB_HUB_PORTINFO;
+    command.data = &portinfo;
+    if( usbfs->ioctl( fd, IOCTL_USB_IOCTL, &command ) < 0 ) return 0;
 
-	    if( timeout )
-	    {
-		/* compare with actual time, as the select timeout is not that precise */
-		gettimeofday(&tv_now, NULL);
+    memcpy( ports, portinfo.port, portinfo.numports );
+    return portinfo.numports;
+}
 
-		if( ( tv_now.tv_sec > tv_ref.tv_sec )
-		 || ( ( tv_now.tv_sec == tv_ref.tv_sec )
-		   && ( tv_now.tv_usec >= tv_ref.tv_usec ) ) )
-		    waiting = 0;
-	    }
+struct sysfs_device
+{
+    struct usb_scan_device entry;
+    unsigned char *desc;
+    unsigned char ports[sizeof(((struct usb_hub_portinfo *)0)->port)];
+};
+
+static int sysfs_device_cmp( const void *a, const void *b )
+{
+    return strcmp( ((const struct sysfs_device *)a)->entry.port, ((const struct sysfs_device *)b)->entry.port );
+}
+
+/*
+ * sysfs names devices after where they are plugged in: usbB is the root hub
+ * of bus B, B-P is on its port P and B-P.Q on port Q of that. The hub is put
+ * in parent, the port number returned, 0 for root hubs.
+ */
+static int sysfs_parent( const char *name, char *parent, size_t size )
+{
+    const char *dot = strrchr( name, '.' ), *dash = strchr( name, '-' );
+
+    if( !dash ) return 0;
+    if( dot && dot > dash )
+    {
+	snprintf( parent, size, "%.*s", (int)( dot - name ), name );
+	return atoi( dot + 1 );
+    }
+    snprintf( parent, size, "usb%.*s", (int)( dash - name ), name );
+    return atoi( dash + 1 );
+}
+
+/*
+ * The sysfs directory of every USB device has its bus and device number and
+ * the descriptors the kernel has cached, and its name tells the hub port it
+ * is on. Nothing is opened in devfs, no device is woken up.
+ */
+static int sysfs_scan( DIR *dir, void *buffer, unsigned int size )
+{
+    struct sysfs_device *devices = NULL, *tmp, *hub;
+    unsigned int used = 0, count = 0, capacity = 0, i;
+    struct dirent *de;
+
+    while( ( de = readdir( dir ) ) )
+    {
+	struct sysfs_device *device;
+	unsigned char *desc;
+	struct stat st;
+	int fd, len, busnum, devnum, maxchild = 0;
+
+	/* Interfaces have a : in their names */
+	if( de->d_name[0] == '.' || strchr( de->d_name, ':' ) || strlen( de->d_name ) >= sizeof(devices->entry.port) ) continue;
+	if( ( fd = openat( dirfd( dir ), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) < 0 ) continue;
+
+	if( fstat( fd, &st ) < 0 || ( busnum = sysfs_read_int( fd, "busnum" ) ) <= 0 ||
+	    ( devnum = sysfs_read_int( fd, "devnum" ) ) <= 0 || ( len = sysfs_read( fd, "descriptors", &desc ) ) < 0 )
+	{
+	    close( fd );
+	    continue;
 	}
+	if( len >= USBFS_DT_DEVICE_SIZE && desc[4] == USBFS_CLASS_HUB && ( maxchild = sysfs_read_int( fd, "maxchild" ) ) < 0 )
+	    maxchild = 0;
+	close( fd );
 
-	if( context && context != &urb )
+	if( count == capacity )
 	{
-	    context->usercontext = URB_USERCONTEXT_COOKIE;
-	    /* We need to restart since we got a successful URB, but not ours */
-	    goto restart;
+	    capacity = capacity ? capacity * 2 : 64;
+	    if( !( tmp = realloc( devices, capacity * sizeof(*devices) ) ) )
+	    {
+		free( desc );
+		break;
+	    }
+	    devices = tmp;
 	}
+	device = &devices[count++];
+	memset( device, 0, sizeof(*device) );
+	device->desc = desc;
+	device->entry.desc_length = len;
+	scan_stamp( &device->entry, &st );
+	device->entry.busnum = busnum;
+	device->entry.devnum = devnum;
+	device->entry.numports = maxchild < (int)sizeof(device->ports) ? maxchild : sizeof(device->ports);
+	strcpy( device->entry.port, de->d_name );
+    }
 
-	/*
-	 * If there was an error, that wasn't EAGAIN (no completion), then
-	 * something happened during the reaping and we should return that
-	 * error now
-	 */
-	if( ret < 0 && !urb.usercontext && errno != EAGAIN )
-	    fprintf( stderr, "error reaping URB: %s\n", strerror(errno) );
+    /* Hook every device up to the port of its hub, looked up by name */
+    if( count ) qsort( devices, count, sizeof(*devices), sysfs_device_cmp );
+    for( i = 0; i < count; i++ )
+    {
+	struct sysfs_device key;
+	int port;
+
+	if( ( port = sysfs_parent( devices[i].entry.port, key.entry.port, sizeof(key.entry.port) ) ) <= 0 ||
+	    port > (int)sizeof(key.ports) )
+	    continue;
+	if( !( hub = bsearch( &key, devices, count, sizeof(*devices), sysfs_device_cmp ) ) ) continue;
+	hub->ports[port - 1] = devices[i].entry.devnum;
+	if( hub->entry.numports < port ) hub->entry.numports = port;
+    }
 
-	bytesdone += urb.actual_length;
+    for( i = 0; i < count; i++ )
+    {
+	scan_add( buffer, size, &used, &devices[i].entry, devices[i].desc, devices[i].ports );
+	free( devices[i].desc );
+    }
+    free( devices );
 
-    } while( ( !ret || urb.usercontext ) && bytesdone < size && urb.actual_length == requested );
+    return used;
+}
 
-    /* If the URB didn't complete in success or error, then let's unlink it */
-    if( ret < 0 && !urb.usercontext )
+/* Without sysfs every device node in devfs is opened and read, as usbfs has it */
+static int devfs_scan( const char *devfs, void *buffer, unsigned int size )
+{
+    struct dirent *bus_de, *de;
+    unsigned int used = 0;
+    DIR *dir, *busdir;
+
+    if( !( dir = opendir( devfs ) ) ) return -errno;
+
+    while( ( bus_de = readdir( dir ) ) )
     {
-	int rc;
+	char buspath[PATH_MAX];
+	size_t namelen = strlen( bus_de->d_name );
+
+	/* Buses are numbered */
+	if( bus_de->d_name[0] == '.' || !namelen || !strchr( "0123456789", bus_de->d_name[namelen - 1] ) ) continue;
+	snprintf( buspath, sizeof(buspath), "%s/%s", devfs, bus_de->d_name );
+	if( !( busdir = opendir( buspath ) ) ) continue;
+
+	while( ( de = readdir( busdir ) ) )
+	{
+	    unsigned char *desc, ports[sizeof(((struct usb_hub_portinfo *)0)->port)];
+	    struct usb_connectinfo connectinfo;
+	    struct usb_scan_device entry;
+	    char name[PATH_MAX + 256];
+	    struct stat st;
+	    int fd, len, i;
+
+	    if( de->d_name[0] == '.' ) continue;
+	    snprintf( name, sizeof(name), "%s/%s", buspath, de->d_name );
+	    if( stat( name, &st ) < 0 || ( fd = usbfs_open_node( name ) ) < 0 ) continue;
+
+	    memset( &entry, 0, sizeof(entry) );
+	    scan_stamp( &entry, &st );
+	    entry.busnum = atoi( bus_de->d_name );
+	    entry.devnum = usbfs->ioctl( fd, IOCTL_USB_CONNECTINFO, &connectinfo ) < 0 ?
+			   atoi( de->d_name ) : connectinfo.devnum;
+
+	    if( ( len = read_all( fd, usbfs->read, &desc ) ) < 0 )
+	    {
+		usbfs->close( fd );
+		continue;
+	    }
+	    entry.desc_length = len;
 
-	if( !waiting ) rc = -ETRANSFER_TIMEDOUT;
-	else           rc = urb.status;
+	    /* usbfs has the words of the device descriptor in CPU order, put them back as sysfs has them */
+	    for( i = 2; len >= USBFS_DT_DEVICE_SIZE && i <= 12; i += ( i == 2 ) ? 6 : 2 )
+	    {
+		uint16_t w;
 
-	ret = ioctl( fd, IOCTL_USB_DISCARDURB, &urb);
-	if( ret < 0 && errno != EINVAL )
-	    fprintf( stderr, "error discarding URB: %s\n", strerror(errno) );
+		memcpy( &w, desc + i, 2 );
+		w = htole16( w );
+		memcpy( desc + i, &w, 2 );
+	    }
 
-	/*
-	 * When the URB is unlinked, it gets moved to the completed list and
-	 * then we need to reap it or else the next time we call this function,
-	 * we'll get the previous completion and exit early
-	 */
-	ioctl( fd, IOCTL_USB_REAPURB, &context );
+	    /* Anything but a hub would just say ENOSYS */
+	    if( len >= USBFS_DT_DEVICE_SIZE && desc[4] == USBFS_CLASS_HUB )
+		entry.numports = usbfs_hub_ports( fd, desc, len, ports );
+	    usbfs->close( fd );
 
-	return rc;
+	    scan_add( buffer, size, &used, &entry, desc, ports );
+	    free( desc );
+	}
+	closedir( busdir );
     }
+    closedir( dir );
+
+    return used;
+}
+
+/*
+ * Every USB device of every bus, as usb_scan_device entries packed into
+ * buffer, from sysfs or else from the usbfs tree at devfs. Returns the bytes
+ * the whole scan takes, when that is more than size only the entries that
+ * fit are in buffer. Nothing is read if the hotplug monitor hasn't seen a
+ * change since the scan of *generation.
+ */
+static int usbfs_scan( const char *devfs, void *buffer, unsigned int size, unsigned int *generation, int *unchanged )
+{
+    unsigned int last = *generation;
+    DIR *dir;
+    int ret;
+
+    pthread_once( &usbfs_once, usbfs_init );
+
+    /* Taken before reading, a change meanwhile shows up the next time */
+    *generation = usbfs_hotplug_generation();
+    *unchanged = *generation && *generation == last;
+    if( *unchanged ) return 0;
 
-    return bytesdone;
+    if( usbfs->sysfs_path && ( dir = opendir( usbfs->sysfs_path ) ) )
+    {
+	ret = sysfs_scan( dir, buffer, size );
+	closedir( dir );
+	return ret;
+    }
+    if( !devfs ) return -ENOENT;
+    return devfs_scan( devfs, buffer, size );
 }
 
 static NTSTATUS wrap_open( void *args )
 {
     struct prm_open *p = args;
-    p->ret = open( p->name, p->flags );
+    pthread_once( &usbfs_once, usbfs_init );
+    p->ret = usbfs->open( p->name, p->flags );
+    USBTRACE( USBTRACE_OPEN, p->ret, 0, 0, 0, 0, p->ret < 0 ? -errno : p->ret );
+    if( usbpcap ) usbpcap_open( p->ret, p->name );
     if( p->ret < 0 ) fprintf( stderr, "failed to open %s: %s", p->name, strerror(errno) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
@@ -270,26 +1709,28 @@ static NTSTATUS wrap_open( void *args )
 static NTSTATUS wrap_close( void *args )
 {
     struct prm_close *p = args;
-    p->ret = close( p->fd );
+    usbfs_dev_remove( p->fd );
+    p->ret = usbfs->close( p->fd );
+    USBTRACE( USBTRACE_CLOSE, p->fd, 0, 0, 0, 0, p->ret < 0 ? -errno : 0 );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
 static NTSTATUS wrap_read( void *args )
 {
     struct prm_read *p = args;
-    p->ret = read( p->fd, p->dst, p->count );
+    p->ret = usbfs->read( p->fd, p->dst, p->count );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
 static NTSTATUS wrap_ioctl( void *args )
 {
     struct prm_ioctl *p = args;
+    /*
+     * No URB ioctls here: every URB on an fd has to go through the completion
+     * dispatcher, the PE side uses unix_usb_urb_batch for them.
+     */
     switch( p->id )
     {
-	case X_IOCTL_USB_SUBMITURB:     p->id = IOCTL_USB_SUBMITURB; break;
-	case X_IOCTL_USB_REAPURBNDELAY: p->id = IOCTL_USB_REAPURBNDELAY; break;
-	case X_IOCTL_USB_DISCARDURB:    p->id = IOCTL_USB_DISCARDURB; break;
-	case X_IOCTL_USB_REAPURB:       p->id = IOCTL_USB_REAPURB; break;
 	case X_IOCTL_USB_CONNECTINFO:   p->id = IOCTL_USB_CONNECTINFO; break;
 	case X_IOCTL_USB_IOCTL:         p->id = IOCTL_USB_IOCTL; break;
 	default:
@@ -297,7 +1738,7 @@ static NTSTATUS wrap_ioctl( void *args )
 	    fprintf( stderr, "ioctl error: unknown ioctl 0x%X\n", p->id );
 	    return STATUS_UNSUCCESSFUL;
     }
-    p->ret = ioctl( p->fd, p->id, p->arg );
+    p->ret = usbfs->ioctl( p->fd, p->id, p->arg );
     if( p->ret < 0 )
 	fprintf( stderr, "ioctl( %d, 0x%X, %p ) error: %s\n", p->fd, p->id, p->arg, strerror(errno) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
@@ -313,7 +1754,7 @@ static NTSTATUS wrap_usb_urb_transfer( void *args )
 static NTSTATUS wrap_usb_control_msg( void *args )
 {
     struct prm_usb_control_msg *p = args;
-    p->ret = _usb_control_msg( p->fd, p->requesttype, p->request, p->value, p->index, p->bytes, p->size, p->timeout );
+    p->ret = usbfs_control_msg( p->fd, p->requesttype, p->request, p->value, p->index, p->bytes, p->size, p->timeout );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
@@ -331,7 +1772,7 @@ static NTSTATUS wrap_usb_set_configuration( void *args )
     /* detach kernel driver for windows program ( Stanson <me@stanson.ch > ) */
     _usb_detach_kernel_driver_np( p->fd, 0 );
 
-    p->ret = ioctl( p->fd, IOCTL_USB_SETCONFIG, &p->configuration );
+    p->ret = usbfs->ioctl( p->fd, IOCTL_USB_SETCONFIG, &p->configuration );
     if( p->ret < 0 ) fprintf( stderr, "could not set config %d: %s", p->configuration, strerror( errno ) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
@@ -343,7 +1784,7 @@ static NTSTATUS wrap_usb_claim_interface( void *args )
     /* detach kernel driver for windows program ( Stanson <me@stanson.ch > ) */
     _usb_detach_kernel_driver_np( p->fd, p->intf );
 
-    p->ret = ioctl( p->fd, IOCTL_USB_CLAIMINTF, &p->intf );
+    p->ret = usbfs->ioctl( p->fd, IOCTL_USB_CLAIMINTF, &p->intf );
     if( p->ret < 0 ) fprintf( stderr, "could not claim interface %d: %s\n", p->intf, strerror( errno ) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
@@ -351,7 +1792,7 @@ static NTSTATUS wrap_usb_claim_interface( void *args )
 static NTSTATUS wrap_usb_release_interface( void *args )
 {
     struct prm_usb_release_interface *p = args;
-    p->ret = ioctl( p->fd, IOCTL_USB_RELEASEINTF, &p->intf );
+    p->ret = usbfs->ioctl( p->fd, IOCTL_USB_RELEASEINTF, &p->intf );
     if( p->ret < 0 ) fprintf( stderr, "could not release intf %d: %s", p->intf, strerror( errno ) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
@@ -366,7 +1807,7 @@ static NTSTATUS wrap_usb_set_altinterface( void *args )
 static NTSTATUS wrap_usb_resetep( void *args )
 {
     struct prm_usb_resetep *p = args;
-    p->ret = ioctl( p->fd, IOCTL_USB_RESETEP, &p->ep );
+    p->ret = usbfs->ioctl( p->fd, IOCTL_USB_RESETEP, &p->ep );
     if( p->ret < 0 ) fprintf( stderr, "could not reset ep %d: %s", p->ep, strerror( errno ) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
@@ -374,15 +1815,74 @@ static NTSTATUS wrap_usb_resetep( void *args )
 static NTSTATUS wrap_usb_clear_halt( void *args )
 {
     struct prm_usb_clear_halt *p = args;
-    p->ret = ioctl( p->fd, IOCTL_USB_CLEAR_HALT, &p->ep );
+    p->ret = usbfs->ioctl( p->fd, IOCTL_USB_CLEAR_HALT, &p->ep );
     if( p->ret < 0 ) fprintf( stderr, "could not clear halt ep %d: %s", p->ep, strerror( errno ) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+static NTSTATUS wrap_usb_alloc_buffer( void *args )
+{
+    struct prm_usb_alloc_buffer *p = args;
+    p->ret = usbfs_alloc_buffer( p->fd, p->size, &p->buffer );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wrap_usb_free_buffer( void *args )
+{
+    struct prm_usb_free_buffer *p = args;
+    p->ret = usbfs_free_buffer( p->fd, p->buffer );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wrap_usb_urb_batch( void *args )
+{
+    struct prm_usb_urb_batch *p = args;
+    p->ret = usbfs_urb_batch( p->fd, p->ops, p->count );
+    return p->ret == p->count ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+/* Root of the emulated usbfs tree, -ENOENT when the kernel's is to be used */
+static int usbfs_get_devfs_path( char *path, unsigned int size )
+{
+    pthread_once( &usbfs_once, usbfs_init );
+    if( !usbfs->devfs_path ) return -ENOENT;
+    if( strlen( usbfs->devfs_path ) >= size ) return -ENAMETOOLONG;
+    strcpy( path, usbfs->devfs_path );
+    return 0;
+}
+
+static NTSTATUS wrap_get_devfs_path( void *args )
+{
+    struct prm_get_devfs_path *p = args;
+    p->ret = usbfs_get_devfs_path( p->path, p->size );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wrap_usb_get_stats( void *args )
+{
+    struct prm_usb_get_stats *p = args;
+    p->ret = usbfs_get_stats( p->fd, p->stats, p->reset );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wrap_usb_scan( void *args )
+{
+    struct prm_usb_scan *p = args;
+    p->ret = usbfs_scan( p->path, p->buffer, p->size, &p->generation, &p->unchanged );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wrap_usb_hotplug_wait( void *args )
+{
+    struct prm_usb_hotplug_wait *p = args;
+    p->ret = usbfs_hotplug_wait( &p->generation, p->timeout );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
 static NTSTATUS wrap_usb_reset( void *args )
 {
     struct prm_usb_reset *p = args;
-    p->ret = ioctl( p->fd, IOCTL_USB_RESET, NULL);
+    p->ret = usbfs->ioctl( p->fd, IOCTL_USB_RESET, NULL);
     if( p->ret < 0 ) fprintf( stderr, "could not reset: %s", strerror(errno) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
@@ -403,6 +1903,13 @@ const unixlib_entry_t __wine_unix_call_funcs[] =
     wrap_usb_clear_halt,
     wrap_usb_reset,
     wrap_usb_get_driver_np,
+    wrap_usb_alloc_buffer,
+    wrap_usb_free_buffer,
+    wrap_usb_urb_batch,
+    wrap_get_devfs_path,
+    wrap_usb_get_stats,
+    wrap_usb_scan,
+    wrap_usb_hotplug_wait,
 };
 
 #ifdef _WIN64
@@ -410,14 +1917,17 @@ const unixlib_entry_t __wine_unix_call_funcs[] =
 static NTSTATUS wow64_open( void *args )
 {
     struct p32_open *p = args;
-    p->ret = open( ULongToPtr( p->name ), p->flags );
+    pthread_once( &usbfs_once, usbfs_init );
+    p->ret = usbfs->open( ULongToPtr( p->name ), p->flags );
+    USBTRACE( USBTRACE_OPEN, p->ret, 0, 0, 0, 0, p->ret < 0 ? -errno : p->ret );
+    if( usbpcap ) usbpcap_open( p->ret, ULongToPtr( p->name ) );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL ;
 }
 
 static NTSTATUS wow64_read( void *args )
 {
     struct p32_read *p = args;
-    p->ret = read( p->fd, ULongToPtr( p->dst ), p->count );
+    p->ret = usbfs->read( p->fd, ULongToPtr( p->dst ), p->count );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
@@ -452,7 +1962,7 @@ static NTSTATUS wow64_usb_urb_transfer( void *args )
 static NTSTATUS wow64_usb_control_msg( void *args )
 {
     struct p32_usb_control_msg *p = args;
-    p->ret = _usb_control_msg( p->fd, p->requesttype, p->request, p->value, p->index, ULongToPtr( p->bytes ), p->size, p->timeout );
+    p->ret = usbfs_control_msg( p->fd, p->requesttype, p->request, p->value, p->index, ULongToPtr( p->bytes ), p->size, p->timeout );
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
@@ -463,6 +1973,53 @@ static NTSTATUS wow64_usb_get_driver_np( void *args )
     return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+/*
+ * usbfs maps its buffers wherever the 64-bit kernel likes, which 32-bit code
+ * can't reach, so WoW64 callers always get the plain copying path.
+ */
+static NTSTATUS wow64_usb_alloc_buffer( void *args )
+{
+    struct p32_usb_alloc_buffer *p = args;
+    p->buffer = 0;
+    p->ret = -ENOSYS;
+    return STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wow64_usb_free_buffer( void *args )
+{
+    struct p32_usb_free_buffer *p = args;
+    p->ret = usbfs_free_buffer( p->fd, ULongToPtr( p->buffer ) );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wow64_usb_urb_batch( void *args )
+{
+    struct p32_usb_urb_batch *p = args;
+    p->ret = usbfs_urb_batch( p->fd, ULongToPtr( p->ops ), p->count );
+    return p->ret == p->count ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wow64_get_devfs_path( void *args )
+{
+    struct p32_get_devfs_path *p = args;
+    p->ret = usbfs_get_devfs_path( ULongToPtr( p->path ), p->size );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wow64_usb_get_stats( void *args )
+{
+    struct p32_usb_get_stats *p = args;
+    p->ret = usbfs_get_stats( p->fd, ULongToPtr( p->stats ), p->reset );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+static NTSTATUS wow64_usb_scan( void *args )
+{
+    struct p32_usb_scan *p = args;
+    p->ret = usbfs_scan( ULongToPtr( p->path ), ULongToPtr( p->buffer ), p->size, &p->generation, &p->unchanged );
+    return p->ret >= 0 ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
 const unixlib_entry_t __wine_unix_call_wow64_funcs[] =
 {
     wow64_open,
@@ -479,6 +2036,13 @@ const unixlib_entry_t __wine_unix_call_wow64_funcs[] =
     wrap_usb_clear_halt,
     wrap_usb_reset,
     wow64_usb_get_driver_np,
+    wow64_usb_alloc_buffer,
+    wow64_usb_free_buffer,
+    wow64_usb_urb_batch,
+    wow64_get_devfs_path,
+    wow64_usb_get_stats,
+    wow64_usb_scan,
+    wrap_usb_hotplug_wait,
 };
 
 #endif  /* _WIN64 */
@@ -72,6 +72,13 @@ enum unix_func
     unix_usb_clear_halt,
     unix_usb_reset,
     unix_usb_get_driver_np,
+    unix_usb_alloc_buffer,
+    unix_usb_free_buffer,
+    unix_usb_urb_batch,
+    unix_get_devfs_path,
+    unix_usb_get_stats,
+    unix_usb_scan,
+    unix_usb_hotplug_wait,
 };
 
 //int wrap_open( char * filename, int flags );
@@ -108,5 +115,99 @@ struct prm_usb_reset { int ret; int fd; };
 //int usb_get_driver_np( usb_dev_handle *dev, int intf, char *name, unsigned int namelen )
 struct prm_usb_get_driver_np { int ret; int fd; int intf; char * name; unsigned int namelen; };
 struct p32_usb_get_driver_np { int ret; int fd; int intf; uint32_t name; unsigned int namelen; };
+//int usbfs_alloc_buffer( int fd, unsigned int size, void **buffer )
+struct prm_usb_alloc_buffer { int ret; int fd; unsigned int size; void * buffer; };
+struct p32_usb_alloc_buffer { int ret; int fd; unsigned int size; uint32_t buffer; };
+//int usbfs_free_buffer( int fd, void *buffer )
+struct prm_usb_free_buffer { int ret; int fd; void * buffer; };
+struct p32_usb_free_buffer { int ret; int fd; uint32_t buffer; };
+
+/* Operations on unix side URBs for unix_usb_urb_batch */
+enum urb_op_code
+{
+    URB_OP_SUBMIT,	/* submit urb (allocated first if 0) for type/endpoint/buffer/length */
+    URB_OP_REAP,	/* wait up to timeout ms (<0 forever) for urb to complete, ret is its actual length */
+    URB_OP_DISCARD,	/* unlink urb, still has to be reaped */
+    URB_OP_FREE,	/* discard and reap urb if in flight, then free it */
+};
+
+/* Laid out so 32 and 64-bit callers share it */
+struct urb_op
+{
+    uint64_t urb;
+    uint64_t buffer;
+    uint64_t packets;	/* REAP: ISO results go to this struct usb_iso_packet_desc array */
+    int op;
+    int ret;		/* 0, REAP: actual length, or -errno */
+    int type;
+    int endpoint;
+    int length;
+    int timeout;
+    int packet_size;	/* SUBMIT: ISO packet size */
+    int packet_count;	/* REAP: room in packets */
+};
+
+//int usbfs_urb_batch( int fd, struct urb_op *ops, unsigned int count ), runs ops in order up to the first failing one
+struct prm_usb_urb_batch { int ret; int fd; unsigned int count; struct urb_op * ops; };
+struct p32_usb_urb_batch { int ret; int fd; unsigned int count; uint32_t ops; };
+//int usbfs_get_devfs_path( char *path, unsigned int size )
+struct prm_get_devfs_path { int ret; char * path; unsigned int size; };
+struct p32_get_devfs_path { int ret; uint32_t path; unsigned int size; };
+
+#define USBFS_STATS_BUCKETS	16
+#define USBFS_STATS_BUCKET0	16	/* us, every bucket after it twice as wide */
+
+/* Same layout as struct usb_ep_stats_np / usb_stats_np in usb.h */
+struct usbfs_ep_stats
+{
+    uint64_t urbs;
+    uint64_t bytes;
+    uint32_t completions;
+    uint32_t timeouts;
+    uint32_t stalls;
+    uint32_t errors;
+    uint32_t discards;
+    uint32_t foreign_reaps;
+    uint32_t latency[USBFS_STATS_BUCKETS];
+};
+
+struct usbfs_stats
+{
+    struct usbfs_ep_stats total;
+    struct usbfs_ep_stats ep[32];
+};
+
+//int usbfs_get_stats( int fd, struct usbfs_stats *stats, int reset )
+struct prm_usb_get_stats { int ret; int fd; int reset; struct usbfs_stats * stats; };
+struct p32_usb_get_stats { int ret; int fd; int reset; uint32_t stats; };
+
+/*
+ * One device in the buffer filled by unix_usb_scan. Its raw descriptors
+ * follow, then for hubs the devnum on every port, 0 for empty ones.
+ */
+struct usb_scan_device
+{
+    uint32_t size;		/* of the entry with what follows, a multiple of 8 */
+    uint32_t desc_length;	/* device descriptor, then every configuration */
+    uint64_t stamp[2];		/* change when another device takes this one's place */
+    uint16_t busnum;
+    uint16_t devnum;
+    uint16_t numports;		/* 0 unless it is a hub */
+    uint16_t reserved;
+    char port[32];		/* sysfs name, usbN for root hubs or bus-port.port..., empty without sysfs */
+};
+
+/*
+ * int usbfs_scan( const char *devfs, void *buffer, unsigned int size, unsigned int *generation ),
+ * bytes the whole scan takes or -errno. devfs is the usbfs tree, read when there is no sysfs.
+ * generation goes in as the one of the caller's last scan and comes back as the hotplug
+ * monitor's, 0 without one; unchanged is set instead of scanning again when no device came
+ * or went since.
+ */
+struct prm_usb_scan { int ret; const char * path; unsigned int size; void * buffer; unsigned int generation; int unchanged; };
+struct p32_usb_scan { int ret; uint32_t path; unsigned int size; uint32_t buffer; unsigned int generation; int unchanged; };
+
+//int usbfs_hotplug_wait( unsigned int *generation, int timeout ), ms or -1, 0 or -errno
+struct prm_usb_hotplug_wait { int ret; unsigned int generation; int timeout; };
 
 #endif
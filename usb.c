@@ -16,52 +16,142 @@
 int usb_debug = 0;
 struct usb_bus *usb_busses = NULL;
 
+static unsigned int usb_index_hash(const char *name)
+{
+  unsigned int hash = 2166136261u;	/* FNV-1a */
+
+  while (*name)
+    hash = (hash ^ (unsigned char)*name++) * 16777619;
+  return hash;
+}
+
+int usb_index_init(struct usb_index *index, unsigned int count)
+{
+  unsigned int size = 8;
+
+  /* At most half full, so probe sequences stay short */
+  while (size < count * 2)
+    size <<= 1;
+
+  index->mask = size - 1;
+  index->count = 0;
+  index->slots = calloc(size, sizeof(*index->slots));
+  return index->slots ? 0 : -ENOMEM;
+}
+
+void usb_index_add(struct usb_index *index, const char *name, void *entry)
+{
+  unsigned int i = usb_index_hash(name) & index->mask;
+
+  while (index->slots[i].name)
+    i = (i + 1) & index->mask;
+  index->slots[i].name = name;
+  index->slots[i].entry = entry;
+  index->count++;
+}
+
+static struct usb_index_slot *usb_index_lookup(struct usb_index *index, const char *name)
+{
+  unsigned int i = usb_index_hash(name) & index->mask;
+
+  /* Taken slots keep their name so that the entries behind them stay reachable */
+  for (; index->slots[i].name; i = (i + 1) & index->mask)
+    if (index->slots[i].entry && !strcmp(index->slots[i].name, name))
+      return &index->slots[i];
+  return NULL;
+}
+
+void *usb_index_find(struct usb_index *index, const char *name)
+{
+  struct usb_index_slot *slot = usb_index_lookup(index, name);
+
+  return slot ? slot->entry : NULL;
+}
+
+void *usb_index_take(struct usb_index *index, const char *name)
+{
+  struct usb_index_slot *slot = usb_index_lookup(index, name);
+  void *entry;
+
+  if (!slot)
+    return NULL;
+  entry = slot->entry;
+  slot->entry = NULL;
+  index->count--;
+  return entry;
+}
+
+/* The entries not taken, *pos starting at 0 */
+void *usb_index_next(struct usb_index *index, unsigned int *pos)
+{
+  while (*pos <= index->mask) {
+    void *entry = index->slots[(*pos)++].entry;
+
+    if (entry)
+      return entry;
+  }
+  return NULL;
+}
+
+void usb_index_free(struct usb_index *index)
+{
+  free(index->slots);
+  index->slots = NULL;
+}
+
 int usb_find_busses(void)
 {
   struct usb_bus *busses, *bus;
+  struct usb_index known;
+  unsigned int count = 0, pos = 0;
   int ret, changes = 0;
 
   ret = usb_os_find_busses(&busses);
   if (ret < 0)
     return ret;
 
+  for (bus = usb_busses; bus; bus = bus->next)
+    count++;
+  if (usb_index_init(&known, count) < 0) {
+    while ((bus = busses)) {
+      LIST_DEL(busses, bus);
+      usb_free_bus(bus);
+    }
+    USB_ERROR(-ENOMEM);
+  }
+  for (bus = usb_busses; bus; bus = bus->next)
+    usb_index_add(&known, bus->dirname, bus);
+
   /*
-   * Now walk through all of the busses we know about and compare against
-   * this new list. Any duplicates will be removed from the new list.
-   * If we don't find it in the new list, the bus was removed. Any
-   * busses still in the new list, are new to us.
+   * Now walk through the new list and look every bus up in the ones we
+   * know about. Any duplicates will be removed from the new list. Those
+   * left in the index were removed from the system, any busses still in
+   * the new list are new to us.
    */
-  bus = usb_busses;
+  bus = busses;
   while (bus) {
-    int found = 0;
-    struct usb_bus *nbus, *tbus = bus->next;
-
-    nbus = busses;
-    while (nbus) {
-      struct usb_bus *tnbus = nbus->next;
-
-      if (!strcmp(bus->dirname, nbus->dirname)) {
-        /* Remove it from the new busses list */
-        LIST_DEL(busses, nbus);
-
-        usb_free_bus(nbus);
-        found = 1;
-        break;
-      }
+    struct usb_bus *tbus = bus->next;
 
-      nbus = tnbus;
-    }
+    if (usb_index_take(&known, bus->dirname)) {
+      /* Remove it from the new busses list */
+      LIST_DEL(busses, bus);
 
-    if (!found) {
-      /* The bus was removed from the system */
-      LIST_DEL(usb_busses, bus);
       usb_free_bus(bus);
-      changes++;
     }
 
     bus = tbus;
   }
 
+  while ((bus = usb_index_next(&known, &pos))) {
+    /* The bus was removed from the system */
+    if (usb_debug >= 2)
+      fprintf(stderr, "usb_find_busses: %s removed\n", bus->dirname);
+    LIST_DEL(usb_busses, bus);
+    usb_free_bus(bus);
+    changes++;
+  }
+  usb_index_free(&known);
+
   /*
    * Anything on the *busses list is new. So add them to usb_busses and
    * process them like the new bus it is.
@@ -78,6 +168,8 @@ int usb_find_busses(void)
 
     LIST_ADD(usb_busses, bus);
 
+    if (usb_debug >= 2)
+      fprintf(stderr, "usb_find_busses: %s added\n", bus->dirname);
     changes++;
 
     bus = tbus;
@@ -93,49 +185,60 @@ int usb_find_devices(void)
 
   for (bus = usb_busses; bus; bus = bus->next) {
     struct usb_device *devices, *dev;
+    struct usb_index known;
+    unsigned int count = 0, pos = 0;
 
     /* Find all of the devices and put them into a temporary list */
     ret = usb_os_find_devices(bus, &devices);
     if (ret < 0)
       return ret;
 
+    for (dev = bus->devices; dev; dev = dev->next)
+      count++;
+    if (usb_index_init(&known, count) < 0) {
+      while ((dev = devices)) {
+        LIST_DEL(devices, dev);
+        usb_free_dev(dev);
+      }
+      USB_ERROR(-ENOMEM);
+    }
+    for (dev = bus->devices; dev; dev = dev->next)
+      usb_index_add(&known, dev->filename, dev);
+
     /*
-     * Now walk through all of the devices we know about and compare
-     * against this new list. Any duplicates will be removed from the new
-     * list. If we don't find it in the new list, the device was removed.
-     * Any devices still in the new list, are new to us.
+     * Now walk through the new list and look every device up in the ones
+     * we know about. Any duplicates will be removed from the new list.
+     * Those left in the index were removed from the system, any devices
+     * still in the new list are new to us.
      */
-    dev = bus->devices;
+    dev = devices;
     while (dev) {
-      int found = 0;
-      struct usb_device *ndev, *tdev = dev->next;
+      struct usb_device *tdev = dev->next, *odev;
 
-      ndev = devices;
-      while (ndev) {
-        struct usb_device *tndev = ndev->next;
+      /* Same name but a different device means the old one went away */
+      odev = usb_index_find(&known, dev->filename);
+      if (odev && usb_os_same_device(odev, dev)) {
+        usb_index_take(&known, dev->filename);
 
-        if (!strcmp(dev->filename, ndev->filename)) {
-          /* Remove it from the new devices list */
-          LIST_DEL(devices, ndev);
+        /* Remove it from the new devices list */
+        LIST_DEL(devices, dev);
 
-          usb_free_dev(ndev);
-          found = 1;
-          break;
-        }
-
-        ndev = tndev;
-      }
-
-      if (!found) {
-        /* The device was removed from the system */
-        LIST_DEL(bus->devices, dev);
         usb_free_dev(dev);
-        changes++;
       }
 
       dev = tdev;
     }
 
+    while ((dev = usb_index_next(&known, &pos))) {
+      /* The device was removed from the system */
+      if (usb_debug >= 2)
+        fprintf(stderr, "usb_find_devices: %s/%s removed\n", bus->dirname, dev->filename);
+      LIST_DEL(bus->devices, dev);
+      usb_free_dev(dev);
+      changes++;
+    }
+    usb_index_free(&known);
+
     /*
      * Anything on the *devices list is new. So add them to bus->devices and
      * process them like the new device it is.
@@ -167,6 +270,8 @@ int usb_find_devices(void)
         }
       }
 
+      if (usb_debug >= 2)
+        fprintf(stderr, "usb_find_devices: %s/%s added\n", bus->dirname, dev->filename);
       changes++;
 
       dev = tdev;
@@ -291,6 +396,7 @@ struct usb_device *usb_device(usb_dev_handle *dev)
 void usb_free_dev(struct usb_device *dev)
 {
   usb_destroy_configuration(dev);
+  usb_os_free_device(dev);
   free(dev->children);
   free(dev);
 }
@@ -329,6 +329,53 @@ int usb_get_driver_np( usb_dev_handle *dev, int interface, char *name, unsigned
 int usb_detach_kernel_driver_np( usb_dev_handle *dev, int interface );
 #endif
 
+/*
+ * Buffers mapped from the kernel's usbfs memory. Transfers from or into them
+ * skip a copy. They belong to dev and go away with usb_close().
+ */
+void *usb_alloc_buffer_np(usb_dev_handle *dev, int size);
+int usb_free_buffer_np(usb_dev_handle *dev, void *buffer);
+
+/*
+ * Transfer statistics of an open device, kept since usb_open() or the last
+ * reset. Bucket i of latency counts transfers that took less than
+ * 16us << i from submission to completion, the last one everything slower.
+ */
+#define USB_STATS_LATENCY_BUCKETS 16
+
+struct usb_ep_stats_np {
+	uint64_t urbs;			/* submitted */
+	uint64_t bytes;			/* actually transferred */
+	uint32_t completions;
+	uint32_t timeouts;		/* waits that gave up on a URB */
+	uint32_t stalls;
+	uint32_t errors;		/* any other failure */
+	uint32_t discards;		/* URBs unlinked before completing */
+	uint32_t foreign_reaps;		/* completions reaped by another thread's wait */
+	uint32_t latency[USB_STATS_LATENCY_BUCKETS];
+};
+
+struct usb_stats_np {
+	struct usb_ep_stats_np total;
+	struct usb_ep_stats_np ep[32];	/* OUT endpoints 0-15, then IN endpoints 0-15 */
+};
+
+int usb_get_stats_np(usb_dev_handle *dev, struct usb_stats_np *stats, int reset);
+
+/*
+ * Devices coming and going, as the kernel reports them. After every change
+ * the event (auto-reset, owned by the library) is set and the callbacks are
+ * run from a thread of the library; usb_find_busses() and usb_find_devices()
+ * then pick it up, and are cheap while nothing changed. Unregistering
+ * waits for the callback if it is running, unless called from the callback
+ * itself. NULL or < 0 if devices can't be watched.
+ */
+typedef void (*usb_hotplug_callback_np)(void *context);
+
+void *usb_hotplug_event_np(void);
+int usb_hotplug_register_np(usb_hotplug_callback_np callback, void *context);
+int usb_hotplug_unregister_np(usb_hotplug_callback_np callback, void *context);
+
 const char *usb_strerror(void);
 
 void usb_init(void);
@@ -341,12 +388,35 @@ struct usb_bus *usb_get_busses(void);
 
 int usb_bulk_setup_async(usb_dev_handle *dev, void **context,
                      unsigned char ep);
+int usb_interrupt_setup_async(usb_dev_handle *dev, void **context,
+                          unsigned char ep);
+int usb_isochronous_setup_async(usb_dev_handle *dev, void **context,
+                            unsigned char ep, int pktsize);
 
 int usb_submit_async(void *context, char *bytes, int size);
+/*
+ * As in libusb-win32, usb_reap_async() cancels a request that times out;
+ * before usb_cancel_async() worked it was left pending. Reap with
+ * usb_reap_async_nocancel() to keep it in flight and reap it again later.
+ */
 int usb_reap_async(void *context, int timeout);
+int usb_reap_async_nocancel(void *context, int timeout);
 int usb_free_async(void **context);
 int usb_cancel_async (void *context);
 
+/*
+ * Per packet results of the last isochronous request reaped on context.
+ * Packet i covers bytes i * pktsize onwards of the buffer.
+ */
+struct usb_iso_packet_np {
+	unsigned int length;
+	unsigned int actual_length;
+	int status;
+};
+
+int usb_isochronous_get_packets_np(void *context,
+                               struct usb_iso_packet_np *packets, int count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,301 @@
+/*
+ * usbbench - throughput and latency of libusb0.dll
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   Windows program run by `make bench` under Wine, with USB_EMULATOR
+ *   pointing at usbbench.dev. Every test is a series of transfers timed
+ *   one by one; it reports MB/s, latency percentiles, usbfs calls per
+ *   transfer (counted by the emulator) and process CPU time per transfer.
+ *
+ *   usbbench [name...] runs only the tests whose names start with one of
+ *   the arguments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "usb.h"
+
+#define BENCH_VID	0x1209
+#define BENCH_PID	0x0001
+
+#define EP_FAST_IN	0x81	/* no bandwidth limit, no latency: software overhead only */
+#define EP_FAST_OUT	0x02
+#define EP_INT_IN	0x83	/* one URB per 125us microframe */
+#define EP_HS_IN	0x84	/* paced like a high-speed device */
+
+#define TIMEOUT		5000
+#define ASYNC_DEPTH	8
+
+/* Emulator's reserved vendor request, see usbemu.c */
+#define EMU_REQ_COUNTERS	0xff
+#define EMU_CALL_COUNT		6
+
+struct bench
+{
+    const char *name;
+    int (*run)( usb_dev_handle *h, int ep, char *buf, int size );
+    int ep;
+    int size;
+    int count;
+};
+
+static usb_dev_handle *bench_dev;
+static char **bench_filter;
+static int bench_nfilter;
+
+static double now_us(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+
+    if( !freq.QuadPart ) QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &t );
+    return (double)t.QuadPart * 1e6 / freq.QuadPart;
+}
+
+static double cpu_us(void)
+{
+    FILETIME create, exit, kernel, user;
+    ULARGE_INTEGER k, u;
+
+    GetProcessTimes( GetCurrentProcess(), &create, &exit, &kernel, &user );
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return ( k.QuadPart + u.QuadPart ) / 10.0;
+}
+
+/* usbfs calls answered by the emulator so far, all of them */
+static unsigned long usbfs_calls(void)
+{
+    unsigned char buf[EMU_CALL_COUNT * 4];
+    unsigned long total = 0;
+    int i, ret;
+
+    ret = usb_control_msg( bench_dev, 0xc0, EMU_REQ_COUNTERS, 0, 0, (char *)buf, sizeof(buf), TIMEOUT );
+    for( i = 0; i + 4 <= ret; i += 4 )
+	total += buf[i] | buf[i + 1] << 8 | buf[i + 2] << 16 | (unsigned long)buf[i + 3] << 24;
+    return total;
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report( const char *name, int size, int count, double bytes, double wall, double cpu,
+		    unsigned long calls, double *lat )
+{
+    qsort( lat, count, sizeof(*lat), cmp_double );
+    printf( "%-16s %8d %6d %9.1f %9.1f %9.1f %9.1f %10.2f %10.2f\n",
+	    name, size, count, bytes / wall, lat[count * 50 / 100], lat[count * 99 / 100],
+	    lat[count * 999 / 1000], (double)calls / count, cpu / count );
+}
+
+static int selected( const char *name )
+{
+    int i;
+
+    if( !bench_nfilter ) return 1;
+    for( i = 0; i < bench_nfilter; i++ )
+	if( !strncmp( name, bench_filter[i], strlen( bench_filter[i] ) ) ) return 1;
+    return 0;
+}
+
+/* Time count calls of b->run, one by one */
+static void run_sync( const struct bench *b )
+{
+    double *lat = malloc( b->count * sizeof(*lat) ), bytes = 0, wall, cpu;
+    char *buf = malloc( b->size + 1 );
+    unsigned long calls;
+    int i, ret;
+
+    if( !lat || !buf || !selected( b->name ) ) goto out;
+
+    calls = usbfs_calls();
+    cpu = cpu_us();
+    wall = now_us();
+    for( i = 0; i < b->count; i++ )
+    {
+	double t = now_us();
+
+	ret = b->run( bench_dev, b->ep, buf, b->size );
+	lat[i] = now_us() - t;
+	if( ret < 0 )
+	{
+	    printf( "%-16s failed: %s\n", b->name, usb_strerror() );
+	    goto out;
+	}
+	bytes += ret;
+    }
+    wall = now_us() - wall;
+    cpu = cpu_us() - cpu;
+    calls = usbfs_calls() - calls - 1;	/* minus the counter request itself */
+
+    report( b->name, b->size, b->count, bytes, wall, cpu, calls, lat );
+out:
+    free( lat );
+    free( buf );
+}
+
+static int do_bulk_read( usb_dev_handle *h, int ep, char *buf, int size )
+{
+    return usb_bulk_read( h, ep, buf, size, TIMEOUT );
+}
+
+static int do_bulk_write( usb_dev_handle *h, int ep, char *buf, int size )
+{
+    return usb_bulk_write( h, ep, buf, size, TIMEOUT );
+}
+
+static int do_interrupt_read( usb_dev_handle *h, int ep, char *buf, int size )
+{
+    return usb_interrupt_read( h, ep, buf, size, TIMEOUT );
+}
+
+/* Vendor request read back from the emulator's scratch registers */
+static int do_control( usb_dev_handle *h, int ep, char *buf, int size )
+{
+    return usb_control_msg( h, 0xc0, 0x01, 0, 0, buf, size, TIMEOUT );
+}
+
+static int do_find_devices( usb_dev_handle *h, int ep, char *buf, int size )
+{
+    usb_find_busses();
+    return usb_find_devices() < 0 ? -1 : 0;
+}
+
+/*
+ * ASYNC_DEPTH requests kept in flight with usb_submit_async, reaped in
+ * order; the latency of each is from its reap call to the data.
+ */
+static void run_async( const char *name, int ep, int size, int count )
+{
+    void *context[ASYNC_DEPTH] = { 0 };
+    char *buf[ASYNC_DEPTH] = { 0 };
+    double *lat = malloc( count * sizeof(*lat) ), bytes = 0, wall, cpu;
+    unsigned long calls;
+    int i, ret;
+
+    if( !lat || !selected( name ) ) goto out;
+
+    for( i = 0; i < ASYNC_DEPTH; i++ )
+	if( !( buf[i] = malloc( size ) ) || usb_bulk_setup_async( bench_dev, &context[i], ep ) < 0 ) goto out;
+
+    calls = usbfs_calls();
+    cpu = cpu_us();
+    wall = now_us();
+    for( i = 0; i < ASYNC_DEPTH && i < count; i++ )
+	if( usb_submit_async( context[i], buf[i], size ) < 0 ) goto fail;
+
+    for( i = 0; i < count; i++ )
+    {
+	int slot = i % ASYNC_DEPTH;
+	double t = now_us();
+
+	ret = usb_reap_async( context[slot], TIMEOUT );
+	lat[i] = now_us() - t;
+	if( ret < 0 ) goto fail;
+	bytes += ret;
+
+	if( i + ASYNC_DEPTH < count && usb_submit_async( context[slot], buf[slot], size ) < 0 ) goto fail;
+    }
+    wall = now_us() - wall;
+    cpu = cpu_us() - cpu;
+    calls = usbfs_calls() - calls - 1;
+
+    report( name, size, count, bytes, wall, cpu, calls, lat );
+    goto out;
+
+fail:
+    printf( "%-16s failed: %s\n", name, usb_strerror() );
+out:
+    for( i = 0; i < ASYNC_DEPTH; i++ )
+    {
+	if( context[i] ) usb_free_async( &context[i] );
+	free( buf[i] );
+    }
+    free( lat );
+}
+
+static const struct bench benches[] =
+{
+    { "bulk_read",      do_bulk_read,      EP_FAST_IN,  64 * 1024,   2000 },
+    { "bulk_read",      do_bulk_read,      EP_FAST_IN,  1024 * 1024, 200 },
+    { "bulk_read_hs",   do_bulk_read,      EP_HS_IN,    1024 * 1024, 50 },
+    { "bulk_write",     do_bulk_write,     EP_FAST_OUT, 64 * 1024,   2000 },
+    { "bulk_write",     do_bulk_write,     EP_FAST_OUT, 1024 * 1024, 200 },
+    { "interrupt_read", do_interrupt_read, EP_INT_IN,   64,          5000 },
+    { "control",        do_control,        0,           64,          5000 },
+    { "find_devices",   do_find_devices,   0,           0,           200 },
+};
+
+int main( int argc, char **argv )
+{
+    struct usb_device *found = NULL;
+    struct usb_bus *bus;
+    char scratch[64];
+    unsigned int i;
+
+    bench_filter = argv + 1;
+    bench_nfilter = argc - 1;
+
+    usb_init();
+    usb_find_busses();
+    usb_find_devices();
+
+    for( bus = usb_get_busses(); bus && !found; bus = bus->next )
+    {
+	struct usb_device *dev;
+
+	for( dev = bus->devices; dev; dev = dev->next )
+	    if( dev->descriptor.idVendor == BENCH_VID && dev->descriptor.idProduct == BENCH_PID )
+	    {
+		found = dev;
+		break;
+	    }
+    }
+    if( !found || !( bench_dev = usb_open( found ) ) )
+    {
+	fprintf( stderr, "usbbench: no %04x:%04x, is USB_EMULATOR set to usbbench.dev?\n", BENCH_VID, BENCH_PID );
+	return 1;
+    }
+    usb_set_configuration( bench_dev, 1 );
+    usb_claim_interface( bench_dev, 0 );
+
+    /* Something for the control test to read back */
+    memset( scratch, 0x55, sizeof(scratch) );
+    usb_control_msg( bench_dev, 0x40, 0x01, 0, 0, scratch, sizeof(scratch), TIMEOUT );
+
+    printf( "%-16s %8s %6s %9s %9s %9s %9s %10s %10s\n",
+	    "test", "size", "count", "MB/s", "p50 us", "p99 us", "p999 us", "calls/xfer", "cpu us" );
+
+    for( i = 0; i < sizeof(benches) / sizeof(benches[0]); i++ ) run_sync( &benches[i] );
+    run_async( "async_read", EP_FAST_IN, 64 * 1024, 2000 );
+    run_async( "async_read_hs", EP_HS_IN, 64 * 1024, 500 );
+
+    usb_release_interface( bench_dev, 0 );
+    usb_close( bench_dev );
+    return 0;
+}
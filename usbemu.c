@@ -0,0 +1,1327 @@
+/*
+ * usbfs emulator
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   Stands in for the kernel's usbfs when USB_EMULATOR names a device
+ *   script, so the transfer engine and enumeration can be run and measured
+ *   without any hardware. The devices live in a directory tree of empty
+ *   files under $TMPDIR, shaped like /dev/bus/usb, which the PE side
+ *   enumerates as usual; the fds are real fds of those files, everything
+ *   else done to them is answered here. A sysfs look-alike next to them
+ *   has busnum, devnum, descriptors and maxchild for usbfs_scan().
+ *   Devices coming and going are announced on a socket pair in the format
+ *   of the kernel's uevents, for the hotplug monitor.
+ *
+ *   Device script, one statement per line, # starts a comment:
+ *
+ *     device <vid>:<pid> [bus=N] [class=N] [speed=low|full|high|super]
+ *            [caps=N] [manufacturer=S] [product=S] [serial=S]
+ *     endpoint <address> bulk|interrupt|iso [maxpacket=N] [interval=N]
+ *            [latency=us] [bandwidth=KB/s] [short=N]
+ *     stall <address> after=N
+ *     connect after=ms
+ *     disconnect after=ms
+ *     config <hex bytes>
+ *
+ *   endpoint, stall, connect, disconnect and config apply to the device
+ *   above them.
+ *   Every bus gets a root hub as device 001. IN endpoints send an endless
+ *   byte counter, OUT endpoints swallow whatever they get, vendor control
+ *   requests read back what the last one wrote. A URB finishes its data
+ *   phase after the ones queued before it on the same endpoint, at the
+ *   endpoint's bandwidth, and completes latency us later. Interrupt URBs
+ *   take at least one interval, iso ones one interval per packet. short=N
+ *   ends every IN URB after N bytes. The N'th URB on a stalling endpoint and
+ *   all after it fail with EPIPE until the halt is cleared. A connecting
+ *   device shows up the given time after the emulator started, a
+ *   disconnecting one goes away the given time after it was first opened,
+ *   both with an add or remove uevent. config
+ *   lines replace the generated configuration descriptor, one line each.
+ *
+ *   Vendor IN request EMU_REQ_COUNTERS is reserved: it returns how many
+ *   open, close, read, ioctl, poll and mmap calls the emulator has answered
+ *   so far, as little endian 32-bit counters, the request itself included.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "usbfs.h"
+
+#define EMU_MAX_EPS		30
+#define EMU_MAX_CONFIGS		8
+#define EMU_MAX_PORTS		127
+#define EMU_SCRATCH		256
+
+#define EMU_DT_DEVICE		0x01
+#define EMU_DT_CONFIG		0x02
+#define EMU_DT_STRING		0x03
+#define EMU_DT_INTERFACE	0x04
+#define EMU_DT_ENDPOINT		0x05
+#define EMU_CLASS_HUB		9
+
+#define EMU_REQ_COUNTERS	0xff
+
+enum emu_call { EMU_CALL_OPEN, EMU_CALL_CLOSE, EMU_CALL_READ, EMU_CALL_IOCTL, EMU_CALL_POLL, EMU_CALL_MMAP, EMU_CALL_COUNT };
+
+enum emu_speed { EMU_SPEED_LOW, EMU_SPEED_FULL, EMU_SPEED_HIGH, EMU_SPEED_SUPER };
+
+struct emu_ep
+{
+    unsigned char addr;
+    unsigned char type;		/* USB_URB_TYPE_* */
+    int maxpacket;
+    int interval;
+    unsigned int latency;	/* us from the end of the data phase to the completion */
+    unsigned int bandwidth;	/* KB/s, 0 for no limit */
+    int short_len;		/* IN URBs end after this many bytes, 0 for never */
+    int stall_after;		/* the stall_after'th URB stalls, 0 for never */
+    int count;			/* URBs submitted so far */
+    int halted;
+    uint64_t busy_until;	/* us, end of the data phase of the last URB queued */
+    unsigned char pattern;	/* next byte an IN endpoint sends */
+};
+
+struct emu_device
+{
+    struct emu_device *next;
+    int busnum;
+    int devnum;
+    int speed;
+    int hub;
+    uint32_t caps;
+    unsigned char desc[18];
+    unsigned char *configs[EMU_MAX_CONFIGS];
+    int nconfigs;
+    unsigned char *blob;	/* what read() returns: device and configuration descriptors */
+    size_t blob_len;
+    char *strings[3];		/* manufacturer, product, serial */
+    struct emu_ep eps[EMU_MAX_EPS];
+    int neps;
+    int connect_ms;
+    uint64_t connect_at;	/* us, 0 once the device is there */
+    int disconnect_ms;
+    uint64_t gone_at;		/* us, 0 while no disconnect is scheduled */
+    int gone;
+    unsigned char scratch[EMU_SCRATCH];
+    int scratch_len;
+    char path[PATH_MAX];
+    char sysfs[PATH_MAX];	/* its directory in the sysfs look-alike */
+};
+
+struct emu_urb
+{
+    struct emu_urb *next;
+    struct usb_urb *urb;
+    struct emu_ep *ep;
+    uint64_t due;		/* us, when it shows up as completed */
+    int status;			/* 0, or what it completes with without moving data */
+};
+
+struct emu_file
+{
+    struct emu_file *next;
+    int fd;
+    struct emu_device *dev;
+    size_t pos;
+    struct emu_urb *urbs;	/* in submission order */
+};
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cond;	/* any URB or device changed */
+static struct emu_device *emu_devices;
+static struct emu_file *emu_files;
+static char emu_root[PATH_MAX - 128];	/* room for /bus/dev and sysfs/device/file */
+static char emu_sysfs[PATH_MAX - 64];	/* emu_root/sysfs, room for a device and a file */
+static uint32_t emu_calls[EMU_CALL_COUNT];	/* on emulated devices */
+static int emu_uevent_fd = -1;		/* our end of the socket pair handed out by emu_uevent_open() */
+static unsigned int emu_uevent_seqnum;
+
+static uint64_t emu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sleep on emu_cond until the monotonic time until (us), 0 for no limit */
+static void emu_wait( uint64_t until )
+{
+    struct timespec ts;
+
+    if( !until )
+    {
+	pthread_cond_wait( &emu_cond, &emu_lock );
+	return;
+    }
+    ts.tv_sec = until / 1000000;
+    ts.tv_nsec = ( until % 1000000 ) * 1000;
+    pthread_cond_timedwait( &emu_cond, &emu_lock, &ts );
+}
+
+static struct emu_file *emu_file_get( int fd )
+{
+    struct emu_file *file;
+
+    for( file = emu_files; file; file = file->next )
+	if( file->fd == fd ) return file;
+    return NULL;
+}
+
+static struct emu_ep *emu_ep_get( struct emu_device *dev, unsigned int addr )
+{
+    int i;
+
+    for( i = 0; i < dev->neps; i++ )
+	if( dev->eps[i].addr == ( addr & 0xff ) ) return &dev->eps[i];
+    return NULL;
+}
+
+static const char * const emu_sysfs_files[] = { "busnum", "devnum", "descriptors", "maxchild" };
+
+static void emu_remove_sysfs( struct emu_device *dev )
+{
+    char path[PATH_MAX + 16];
+    unsigned int i;
+
+    if( !dev->sysfs[0] ) return;
+    for( i = 0; i < sizeof(emu_sysfs_files) / sizeof(emu_sysfs_files[0]); i++ )
+    {
+	snprintf( path, sizeof(path), "%s/%s", dev->sysfs, emu_sysfs_files[i] );
+	unlink( path );
+    }
+    rmdir( dev->sysfs );
+}
+
+/* What the kernel sends for a USB device being added or removed */
+static void emu_uevent( struct emu_device *dev, const char *action )
+{
+    char msg[PATH_MAX + 512], devpath[PATH_MAX];
+    const char *port = strrchr( dev->sysfs, '/' );
+    int len;
+
+    if( emu_uevent_fd < 0 || !port ) return;
+
+    snprintf( devpath, sizeof(devpath), "/devices/emu/usb%d%s%s", dev->busnum, dev->hub ? "" : "/",
+	      dev->hub ? "" : port + 1 );
+    len = snprintf( msg, sizeof(msg), "%s@%s", action, devpath ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "ACTION=%s", action ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "DEVPATH=%s", devpath ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "SUBSYSTEM=usb" ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "DEVTYPE=usb_device" ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "BUSNUM=%03d", dev->busnum ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "DEVNUM=%03d", dev->devnum ) + 1;
+    len += snprintf( msg + len, sizeof(msg) - len, "SEQNUM=%u", ++emu_uevent_seqnum ) + 1;
+    if( len > (int)sizeof(msg) ) return;
+
+    send( emu_uevent_fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL );
+}
+
+/* Pull the device once its time is up, its URBs complete with ESHUTDOWN */
+static void emu_check_gone( struct emu_device *dev, uint64_t now )
+{
+    struct emu_file *file;
+    struct emu_urb *eu;
+
+    if( dev->gone || !dev->gone_at || now < dev->gone_at ) return;
+
+    dev->gone = 1;
+    unlink( dev->path );
+    /* The kernel removes the attributes before it tells */
+    emu_remove_sysfs( dev );
+    emu_uevent( dev, "remove" );
+    for( file = emu_files; file; file = file->next )
+    {
+	if( file->dev != dev ) continue;
+	for( eu = file->urbs; eu; eu = eu->next )
+	    if( eu->due > now )
+	    {
+		eu->status = -ESHUTDOWN;
+		eu->due = now;
+	    }
+    }
+    pthread_cond_broadcast( &emu_cond );
+}
+
+/* Earliest completion or disconnect on file, UINT64_MAX for none */
+static uint64_t emu_next_event( struct emu_file *file )
+{
+    uint64_t next = UINT64_MAX;
+    struct emu_urb *eu;
+
+    for( eu = file->urbs; eu; eu = eu->next )
+	if( eu->due < next ) next = eu->due;
+    if( !file->dev->gone && file->dev->gone_at && file->dev->gone_at < next ) next = file->dev->gone_at;
+    return next;
+}
+
+static void emu_fill( struct emu_ep *ep, unsigned char *buf, int len )
+{
+    int i;
+
+    for( i = 0; i < len; i++ ) buf[i] = ep->pattern++;
+}
+
+static int emu_submit( struct emu_file *file, struct usb_urb *urb, uint64_t now )
+{
+    struct emu_device *dev = file->dev;
+    struct emu_urb *eu, **tail;
+    struct emu_ep *ep;
+    uint64_t start, frame, xfer = 0;
+    int i, length;
+
+    if( dev->gone ) return -ENODEV;
+    if( !( ep = emu_ep_get( dev, urb->endpoint ) ) ) return -ENOENT;
+    if( ep->type != urb->type || urb->buffer_length < 0 ) return -EINVAL;
+
+    length = urb->buffer_length;
+    if( urb->type == USB_URB_TYPE_ISO )
+    {
+	if( urb->number_of_packets < 1 || urb->number_of_packets > 128 ) return -EINVAL;
+	for( i = 0, length = 0; i < urb->number_of_packets; i++ ) length += urb->iso_frame_desc[i].length;
+	if( length > urb->buffer_length ) return -EINVAL;
+    }
+
+    if( !( eu = calloc( 1, sizeof(*eu) ) ) ) return -ENOMEM;
+    eu->urb = urb;
+    eu->ep = ep;
+
+    urb->status = -EINPROGRESS;
+    urb->actual_length = 0;
+
+    ep->count++;
+    if( ep->stall_after && ep->count == ep->stall_after ) ep->halted = 1;
+
+    /* Periodic endpoints move data once per interval frames at best */
+    frame = (uint64_t)ep->interval * ( dev->speed >= EMU_SPEED_HIGH ? 125 : 1000 );
+    start = now > ep->busy_until ? now : ep->busy_until;
+    if( ep->halted )
+	eu->status = -EPIPE;
+    else if( urb->type == USB_URB_TYPE_ISO )
+	xfer = urb->number_of_packets * frame;
+    else
+    {
+	if( ep->bandwidth ) xfer = (uint64_t)length * 1000 / ep->bandwidth;
+	if( urb->type == USB_URB_TYPE_INTERRUPT && xfer < frame ) xfer = frame;
+    }
+
+    ep->busy_until = start + xfer;
+    eu->due = ep->busy_until + ep->latency;
+
+    for( tail = &file->urbs; *tail; tail = &(*tail)->next );
+    *tail = eu;
+
+    pthread_cond_broadcast( &emu_cond );
+    return 0;
+}
+
+/* Move the data of a URB that is due and fill in its results */
+static void emu_complete( struct emu_file *file, struct emu_urb *eu, uint64_t now )
+{
+    struct usb_urb *urb = eu->urb;
+    struct emu_ep *ep = eu->ep;
+    int in = ep->addr & 0x80;
+    int i, len;
+
+    urb->status = eu->status;
+    urb->actual_length = 0;
+    urb->error_count = 0;
+    if( eu->status ) return;
+
+    if( urb->type == USB_URB_TYPE_ISO )
+    {
+	unsigned char *buf = urb->buffer;
+
+	for( i = 0; i < urb->number_of_packets; i++ )
+	{
+	    struct usb_iso_packet_desc *pkt = &urb->iso_frame_desc[i];
+
+	    if( in ) emu_fill( ep, buf, pkt->length );
+	    pkt->actual_length = pkt->length;
+	    pkt->status = 0;
+	    urb->actual_length += pkt->length;
+	    buf += pkt->length;
+	}
+	return;
+    }
+
+    len = urb->buffer_length;
+    if( in && ep->short_len && len > ep->short_len )
+    {
+	struct emu_urb *next;
+
+	len = ep->short_len;
+
+	/* Like usbfs, a short packet cancels the continuation URBs queued behind it */
+	if( urb->flags & USB_URB_SHORT_NOT_OK )
+	{
+	    urb->status = -EREMOTEIO;
+	    for( next = eu->next; next; next = next->next )
+	    {
+		if( next->ep != ep || next->status ) continue;
+		if( !( next->urb->flags & USB_URB_BULK_CONTINUATION ) ) break;
+		next->status = -ECONNRESET;
+		next->due = now;
+	    }
+	}
+    }
+    if( in ) emu_fill( ep, urb->buffer, len );
+    urb->actual_length = len;
+}
+
+/* Hand out the completed URB that came first, waiting for one if wait */
+static int emu_reap( struct emu_file *file, void **context, int wait )
+{
+    for( ;; )
+    {
+	uint64_t now = emu_now(), next;
+	struct emu_urb **peu, **pbest = NULL, *eu;
+
+	emu_check_gone( file->dev, now );
+	for( peu = &file->urbs; *peu; peu = &(*peu)->next )
+	    if( (*peu)->due <= now && ( !pbest || (*peu)->due < (*pbest)->due ) ) pbest = peu;
+
+	if( pbest )
+	{
+	    eu = *pbest;
+	    *pbest = eu->next;
+	    emu_complete( file, eu, now );
+	    *context = eu->urb;
+	    free( eu );
+	    return 0;
+	}
+
+	if( file->dev->gone ) return -ENODEV;
+	if( !wait ) return -EAGAIN;
+
+	next = emu_next_event( file );
+	emu_wait( next == UINT64_MAX ? 0 : next );
+    }
+}
+
+static int emu_discard( struct emu_file *file, struct usb_urb *urb, uint64_t now )
+{
+    struct emu_urb *eu;
+
+    for( eu = file->urbs; eu; eu = eu->next )
+    {
+	if( eu->urb != urb ) continue;
+	/* completed already, it only has to be reaped */
+	if( eu->due <= now ) break;
+	eu->status = -ENOENT;
+	eu->due = now;
+	pthread_cond_broadcast( &emu_cond );
+	return 0;
+    }
+    return -EINVAL;
+}
+
+static int emu_string( struct emu_device *dev, int index, unsigned char *buf )
+{
+    const char *s;
+    int i, len;
+
+    if( !index )
+    {
+	buf[0] = 4;
+	buf[1] = EMU_DT_STRING;
+	buf[2] = 0x09;	/* English (US) */
+	buf[3] = 0x04;
+	return 4;
+    }
+    if( index > 3 || !( s = dev->strings[index - 1] ) ) return -EPIPE;
+
+    len = strlen( s );
+    if( len > 126 ) len = 126;
+    buf[0] = 2 + len * 2;
+    buf[1] = EMU_DT_STRING;
+    for( i = 0; i < len; i++ )
+    {
+	buf[2 + i * 2] = s[i];
+	buf[3 + i * 2] = 0;
+    }
+    return buf[0];
+}
+
+static int emu_control( struct emu_device *dev, struct usb_ctrltransfer *ctrl )
+{
+    unsigned char buf[256];
+    const unsigned char *src = buf;
+    struct emu_ep *ep;
+    int in = ctrl->bRequestType & 0x80;
+    int len = 0;
+
+    if( dev->gone ) return -ENODEV;
+
+    if( ctrl->bRequestType == 0xc0 && ctrl->bRequest == EMU_REQ_COUNTERS )
+    {
+	int i;
+
+	for( i = 0; i < EMU_CALL_COUNT && len + 4 <= ctrl->wLength; i++, len += 4 )
+	{
+	    unsigned char *p = (unsigned char *)ctrl->data + len;
+
+	    p[0] = emu_calls[i];
+	    p[1] = emu_calls[i] >> 8;
+	    p[2] = emu_calls[i] >> 16;
+	    p[3] = emu_calls[i] >> 24;
+	}
+	return len;
+    }
+
+    /* Other vendor requests: a scratch register file */
+    if( ( ctrl->bRequestType & 0x60 ) == 0x40 )
+    {
+	len = ctrl->wLength;
+	if( in )
+	{
+	    if( len > dev->scratch_len ) len = dev->scratch_len;
+	    memcpy( ctrl->data, dev->scratch, len );
+	}
+	else
+	{
+	    if( len > EMU_SCRATCH ) len = EMU_SCRATCH;
+	    memcpy( dev->scratch, ctrl->data, len );
+	    dev->scratch_len = len;
+	}
+	return len;
+    }
+
+    switch( ctrl->bRequest )
+    {
+	case 0x00:	/* GET_STATUS */
+	    memset( buf, 0, 2 );
+	    len = 2;
+	    break;
+
+	case 0x01:	/* CLEAR_FEATURE */
+	    if( ( ctrl->bRequestType & 0x1f ) == 2 && ctrl->wValue == 0 )
+	    {
+		if( !( ep = emu_ep_get( dev, ctrl->wIndex ) ) ) return -EPIPE;
+		ep->halted = 0;
+	    }
+	    return 0;
+
+	case 0x06:	/* GET_DESCRIPTOR */
+	    switch( ctrl->wValue >> 8 )
+	    {
+		case EMU_DT_DEVICE:
+		    src = dev->desc;
+		    len = sizeof(dev->desc);
+		    break;
+		case EMU_DT_CONFIG:
+		    if( ( ctrl->wValue & 0xff ) >= dev->nconfigs ) return -EPIPE;
+		    src = dev->configs[ctrl->wValue & 0xff];
+		    len = src[2] | src[3] << 8;
+		    break;
+		case EMU_DT_STRING:
+		    if( ( len = emu_string( dev, ctrl->wValue & 0xff, buf ) ) < 0 ) return len;
+		    break;
+		default:
+		    return -EPIPE;
+	    }
+	    break;
+
+	case 0x08:	/* GET_CONFIGURATION */
+	    buf[0] = 1;
+	    len = 1;
+	    break;
+
+	case 0x09:	/* SET_CONFIGURATION */
+	case 0x0b:	/* SET_INTERFACE */
+	    return 0;
+
+	default:
+	    return -EPIPE;
+    }
+
+    if( !in ) return -EPIPE;
+    if( len > ctrl->wLength ) len = ctrl->wLength;
+    memcpy( ctrl->data, src, len );
+    return len;
+}
+
+static int emu_portinfo( struct emu_device *hub, struct usb_hub_portinfo *portinfo )
+{
+    struct emu_device *dev;
+
+    if( !hub->hub ) return -ENOSYS;
+
+    /* Every device has a port of its own, empty while it isn't there */
+    memset( portinfo, 0, sizeof(*portinfo) );
+    for( dev = emu_devices; dev; dev = dev->next )
+	if( dev->busnum == hub->busnum && !dev->hub && portinfo->numports < EMU_MAX_PORTS )
+	    portinfo->port[portinfo->numports++] = dev->connect_at || dev->gone ? 0 : dev->devnum;
+    return 0;
+}
+
+static int emu_do_ioctl( struct emu_file *file, unsigned long request, void *arg )
+{
+    struct emu_device *dev = file->dev;
+    uint64_t now = emu_now();
+    struct emu_ep *ep;
+    int i;
+
+    emu_check_gone( dev, now );
+
+    switch( request )
+    {
+	case IOCTL_USB_SUBMITURB:
+	    return emu_submit( file, arg, now );
+
+	case IOCTL_USB_DISCARDURB:
+	    return emu_discard( file, arg, now );
+
+	case IOCTL_USB_REAPURB:
+	case IOCTL_USB_REAPURBNDELAY:
+	    return emu_reap( file, arg, request == IOCTL_USB_REAPURB );
+
+	case IOCTL_USB_CONTROL:
+	    return emu_control( dev, arg );
+
+	case IOCTL_USB_CONNECTINFO:
+	{
+	    struct usb_connectinfo *ci = arg;
+
+	    ci->devnum = dev->devnum;
+	    ci->slow = dev->speed == EMU_SPEED_LOW;
+	    return 0;
+	}
+
+	case IOCTL_USB_GET_CAPABILITIES:
+	    *(uint32_t *)arg = dev->caps;
+	    return 0;
+
+	case IOCTL_USB_IOCTL:
+	{
+	    struct usb_ioctl *cmd = arg;
+
+	    if( dev->gone ) return -ENODEV;
+	    if( cmd->ioctl_code == (int)IOCTL_USB_HUB_PORTINFO ) return emu_portinfo( dev, cmd->data );
+	    if( cmd->ioctl_code == (int)IOCTL_USB_DISCONNECT ) return -ENODATA;	/* no kernel driver bound */
+	    return -ENOSYS;
+	}
+
+	case IOCTL_USB_GETDRIVER:
+	    return dev->gone ? -ENODEV : -ENODATA;
+
+	case IOCTL_USB_CLEAR_HALT:
+	    if( dev->gone ) return -ENODEV;
+	    if( !( ep = emu_ep_get( dev, *(unsigned int *)arg ) ) ) return -ENOENT;
+	    ep->halted = 0;
+	    return 0;
+
+	case IOCTL_USB_RESET:
+	    if( dev->gone ) return -ENODEV;
+	    for( i = 0; i < dev->neps; i++ ) dev->eps[i].halted = 0;
+	    return 0;
+
+	case IOCTL_USB_RESETEP:
+	case IOCTL_USB_SETCONFIG:
+	case IOCTL_USB_SETINTF:
+	case IOCTL_USB_CLAIMINTF:
+	case IOCTL_USB_RELEASEINTF:
+	    return dev->gone ? -ENODEV : 0;
+
+	default:
+	    return -ENOTTY;
+    }
+}
+
+static int emu_open( const char *name, int flags )
+{
+    struct emu_device *dev;
+    struct emu_file *file;
+    int fd;
+
+    (void)flags;
+    if( ( fd = open( name, O_RDONLY | O_CLOEXEC ) ) < 0 ) return -1;
+
+    pthread_mutex_lock( &emu_lock );
+    for( dev = emu_devices; dev; dev = dev->next )
+	if( !strcmp( dev->path, name ) ) break;
+
+    if( dev && ( file = calloc( 1, sizeof(*file) ) ) )
+    {
+	emu_calls[EMU_CALL_OPEN]++;
+	file->fd = fd;
+	file->dev = dev;
+	file->next = emu_files;
+	emu_files = file;
+	if( dev->disconnect_ms && !dev->gone_at )
+	{
+	    dev->gone_at = emu_now() + (uint64_t)dev->disconnect_ms * 1000;
+	    pthread_cond_broadcast( &emu_cond );
+	}
+    }
+    pthread_mutex_unlock( &emu_lock );
+
+    return fd;
+}
+
+static int emu_close( int fd )
+{
+    struct emu_file **pfile, *file;
+
+    pthread_mutex_lock( &emu_lock );
+    for( pfile = &emu_files; ( file = *pfile ); pfile = &file->next )
+    {
+	if( file->fd != fd ) continue;
+	*pfile = file->next;
+	emu_calls[EMU_CALL_CLOSE]++;
+	/* usbfs drops whatever is still in flight */
+	while( file->urbs )
+	{
+	    struct emu_urb *eu = file->urbs;
+
+	    file->urbs = eu->next;
+	    free( eu );
+	}
+	free( file );
+	break;
+    }
+    pthread_mutex_unlock( &emu_lock );
+
+    return close( fd );
+}
+
+static ssize_t emu_read( int fd, void *buf, size_t count )
+{
+    struct emu_file *file;
+    ssize_t ret;
+
+    pthread_mutex_lock( &emu_lock );
+    if( !( file = emu_file_get( fd ) ) )
+    {
+	pthread_mutex_unlock( &emu_lock );
+	return read( fd, buf, count );
+    }
+
+    emu_calls[EMU_CALL_READ]++;
+    if( file->pos >= file->dev->blob_len ) count = 0;
+    else if( count > file->dev->blob_len - file->pos ) count = file->dev->blob_len - file->pos;
+    memcpy( buf, file->dev->blob + file->pos, count );
+    file->pos += count;
+    ret = count;
+    pthread_mutex_unlock( &emu_lock );
+
+    return ret;
+}
+
+static int emu_ioctl( int fd, unsigned long request, void *arg )
+{
+    struct emu_file *file;
+    int ret;
+
+    pthread_mutex_lock( &emu_lock );
+    if( !( file = emu_file_get( fd ) ) )
+    {
+	pthread_mutex_unlock( &emu_lock );
+	return ioctl( fd, request, arg );
+    }
+    emu_calls[EMU_CALL_IOCTL]++;
+    ret = emu_do_ioctl( file, request, arg );
+    pthread_mutex_unlock( &emu_lock );
+
+    if( ret >= 0 ) return ret;
+    errno = -ret;
+    return -1;
+}
+
+/* Like usbfs: POLLOUT while completed URBs wait to be reaped, POLLHUP once the device is gone */
+static int emu_poll( struct pollfd *fds, nfds_t nfds, int timeout )
+{
+    uint64_t deadline = timeout > 0 ? emu_now() + (uint64_t)timeout * 1000 : 0;
+    struct emu_file *file;
+    int ret = 0;
+
+    pthread_mutex_lock( &emu_lock );
+    if( nfds != 1 || !( file = emu_file_get( fds->fd ) ) )
+    {
+	pthread_mutex_unlock( &emu_lock );
+	return poll( fds, nfds, timeout );
+    }
+    emu_calls[EMU_CALL_POLL]++;
+
+    for( ;; )
+    {
+	uint64_t now = emu_now(), next;
+	short revents = 0;
+
+	emu_check_gone( file->dev, now );
+	next = emu_next_event( file );
+
+	if( file->dev->gone ) revents |= POLLERR | POLLHUP;
+	if( next <= now ) revents |= POLLOUT | POLLWRNORM;
+	fds->revents = revents & ( fds->events | POLLERR | POLLHUP );
+	if( fds->revents )
+	{
+	    ret = 1;
+	    break;
+	}
+
+	if( !timeout || ( deadline && now >= deadline ) ) break;
+	if( deadline && deadline < next ) next = deadline;
+	emu_wait( next == UINT64_MAX ? 0 : next );
+    }
+    pthread_mutex_unlock( &emu_lock );
+
+    return ret;
+}
+
+/* usbfs buffers are plain memory here */
+static void *emu_mmap( void *addr, size_t length, int prot, int flags, int fd, off_t offset )
+{
+    int emulated;
+
+    pthread_mutex_lock( &emu_lock );
+    if( ( emulated = emu_file_get( fd ) != NULL ) ) emu_calls[EMU_CALL_MMAP]++;
+    pthread_mutex_unlock( &emu_lock );
+
+    if( !emulated ) return mmap( addr, length, prot, flags, fd, offset );
+    return mmap( addr, length, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+}
+
+/* The hotplug monitor reads what emu_uevent() sends from the other end */
+static int emu_uevent_open(void)
+{
+    int fds[2], ret = -EBUSY;
+
+    pthread_mutex_lock( &emu_lock );
+    if( emu_uevent_fd < 0 )
+    {
+	if( socketpair( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds ) < 0 ) ret = -errno;
+	else
+	{
+	    emu_uevent_fd = fds[0];
+	    ret = fds[1];
+	}
+    }
+    pthread_mutex_unlock( &emu_lock );
+
+    return ret;
+}
+
+static struct usbfs_ops emu_ops =
+{
+    emu_open,
+    emu_close,
+    emu_read,
+    emu_ioctl,
+    emu_poll,
+    emu_mmap,
+    munmap,
+    emu_root,
+    emu_sysfs,
+    emu_uevent_open,
+};
+
+static void put_le16( unsigned char *p, unsigned int v )
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+/* Generated configuration: one interface holding all the endpoints */
+static unsigned char *emu_make_config( struct emu_device *dev )
+{
+    int len = 9 + 9 + 7 * dev->neps, i;
+    unsigned char *cfg = malloc( len ), *p;
+
+    if( !cfg ) return NULL;
+
+    p = cfg;
+    p[0] = 9;
+    p[1] = EMU_DT_CONFIG;
+    put_le16( p + 2, len );
+    p[4] = 1;		/* bNumInterfaces */
+    p[5] = 1;		/* bConfigurationValue */
+    p[6] = 0;
+    p[7] = 0x80;	/* bus powered */
+    p[8] = 50;		/* 100mA */
+    p += 9;
+
+    p[0] = 9;
+    p[1] = EMU_DT_INTERFACE;
+    p[2] = 0;
+    p[3] = 0;
+    p[4] = dev->neps;
+    p[5] = dev->hub ? EMU_CLASS_HUB : dev->desc[4] ? dev->desc[4] : 0xff;
+    p[6] = 0;
+    p[7] = 0;
+    p[8] = 0;
+    p += 9;
+
+    for( i = 0; i < dev->neps; i++, p += 7 )
+    {
+	static const unsigned char attr[] = { 1, 3, 0, 2 };	/* by USB_URB_TYPE_* */
+	struct emu_ep *ep = &dev->eps[i];
+
+	p[0] = 7;
+	p[1] = EMU_DT_ENDPOINT;
+	p[2] = ep->addr;
+	p[3] = attr[ep->type];
+	put_le16( p + 4, ep->maxpacket );
+	p[6] = ep->interval;
+    }
+
+    return cfg;
+}
+
+/* Fill in the descriptors and the defaults left open by the script */
+static int emu_finish_device( struct emu_device *dev )
+{
+    static const unsigned int bandwidth[] = { 150, 1000, 40000, 400000 };
+    static const unsigned int latency[] = { 1000, 1000, 125, 125 };
+    size_t len;
+    int i;
+
+    for( i = 0; i < dev->neps; i++ )
+    {
+	struct emu_ep *ep = &dev->eps[i];
+
+	if( !ep->maxpacket )
+	{
+	    if( dev->speed == EMU_SPEED_SUPER ) ep->maxpacket = 1024;
+	    else if( dev->speed == EMU_SPEED_HIGH ) ep->maxpacket = ep->type == USB_URB_TYPE_ISO ? 1024 : 512;
+	    else if( dev->speed == EMU_SPEED_FULL ) ep->maxpacket = ep->type == USB_URB_TYPE_ISO ? 1023 : 64;
+	    else ep->maxpacket = 8;
+	}
+	if( !ep->interval ) ep->interval = 1;
+	if( ep->latency == UINT_MAX ) ep->latency = latency[dev->speed];
+	if( ep->bandwidth == UINT_MAX ) ep->bandwidth = bandwidth[dev->speed];
+    }
+
+    dev->desc[0] = 18;
+    dev->desc[1] = EMU_DT_DEVICE;
+    put_le16( dev->desc + 2, dev->speed == EMU_SPEED_SUPER ? 0x0300 : dev->speed == EMU_SPEED_HIGH ? 0x0200 : 0x0110 );
+    dev->desc[7] = dev->speed == EMU_SPEED_SUPER ? 9 : dev->speed == EMU_SPEED_LOW ? 8 : 64;
+    put_le16( dev->desc + 12, 0x0100 );
+    dev->desc[14] = dev->strings[0] ? 1 : 0;
+    dev->desc[15] = dev->strings[1] ? 2 : 0;
+    dev->desc[16] = dev->strings[2] ? 3 : 0;
+
+    if( !dev->nconfigs )
+    {
+	if( !( dev->configs[0] = emu_make_config( dev ) ) ) return -ENOMEM;
+	dev->nconfigs = 1;
+    }
+    dev->desc[17] = dev->nconfigs;
+
+    for( i = 0, len = sizeof(dev->desc); i < dev->nconfigs; i++ )
+	len += dev->configs[i][2] | dev->configs[i][3] << 8;
+    if( !( dev->blob = malloc( len ) ) ) return -ENOMEM;
+
+    memcpy( dev->blob, dev->desc, sizeof(dev->desc) );
+    for( i = 0, len = sizeof(dev->desc); i < dev->nconfigs; i++ )
+    {
+	size_t total = dev->configs[i][2] | dev->configs[i][3] << 8;
+
+	memcpy( dev->blob + len, dev->configs[i], total );
+	len += total;
+    }
+    dev->blob_len = len;
+
+    return 0;
+}
+
+static struct emu_device *emu_new_device( int busnum, int devnum )
+{
+    struct emu_device *dev = calloc( 1, sizeof(*dev) ), **tail;
+
+    if( !dev ) return NULL;
+    dev->busnum = busnum;
+    dev->devnum = devnum;
+    dev->speed = EMU_SPEED_HIGH;
+    dev->caps = USB_CAP_ZERO_PACKET | USB_CAP_BULK_CONTINUATION | USB_CAP_NO_PACKET_SIZE_LIM
+		| USB_CAP_REAP_AFTER_DISCONNECT | USB_CAP_MMAP;
+
+    for( tail = &emu_devices; *tail; tail = &(*tail)->next );
+    *tail = dev;
+    return dev;
+}
+
+static struct emu_ep *emu_new_ep( struct emu_device *dev, unsigned int addr )
+{
+    struct emu_ep *ep;
+
+    if( emu_ep_get( dev, addr ) || dev->neps == EMU_MAX_EPS || !( addr & 0x0f ) ) return NULL;
+
+    ep = &dev->eps[dev->neps++];
+    ep->addr = addr;
+    ep->latency = UINT_MAX;
+    ep->bandwidth = UINT_MAX;
+    return ep;
+}
+
+/* key=value option of a script line, NULL if tok isn't key= */
+static const char *emu_opt( const char *tok, const char *key )
+{
+    size_t len = strlen( key );
+
+    return !strncmp( tok, key, len ) && tok[len] == '=' ? tok + len + 1 : NULL;
+}
+
+static int emu_parse_config( struct emu_device *dev, char *hex )
+{
+    unsigned char *cfg;
+    size_t len = 0;
+    char *tok, *save;
+
+    if( dev->nconfigs == EMU_MAX_CONFIGS || !( cfg = malloc( strlen( hex ) / 2 + 1 ) ) ) return -1;
+
+    for( tok = strtok_r( hex, " \t\r\n", &save ); tok; tok = strtok_r( NULL, " \t\r\n", &save ) )
+    {
+	while( isxdigit( tok[0] ) && isxdigit( tok[1] ) )
+	{
+	    char byte[3] = { tok[0], tok[1], 0 };
+
+	    cfg[len++] = strtoul( byte, NULL, 16 );
+	    tok += 2;
+	}
+	if( *tok ) break;
+    }
+
+    /* wTotalLength decides how much of it is read */
+    if( tok || len < 9 || ( cfg[2] | cfg[3] << 8 ) != len )
+    {
+	free( cfg );
+	return -1;
+    }
+    dev->configs[dev->nconfigs++] = cfg;
+    return 0;
+}
+
+static int emu_parse_line( char *line, struct emu_device **pdev, int *devnums )
+{
+    struct emu_device *dev = *pdev;
+    char *cmd, *tok, *save, *end;
+    const char *val;
+
+    if( ( end = strchr( line, '#' ) ) ) *end = 0;
+    if( !( cmd = strtok_r( line, " \t\r\n", &save ) ) ) return 0;
+
+    if( !strcmp( cmd, "device" ) )
+    {
+	unsigned int vid, pid, bus = 1;
+	char *opts[16];
+	int i, nopts = 0;
+
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) || sscanf( tok, "%x:%x", &vid, &pid ) != 2 ) return -1;
+	while( ( tok = strtok_r( NULL, " \t\r\n", &save ) ) )
+	{
+	    if( ( val = emu_opt( tok, "bus" ) ) ) bus = atoi( val );
+	    else if( nopts < 16 ) opts[nopts++] = tok;
+	    else return -1;
+	}
+	if( bus < 1 || bus > 255 || devnums[bus] >= 127 ) return -1;
+
+	/* the root hub takes 001 */
+	if( !devnums[bus] ) devnums[bus] = 1;
+	if( !( dev = *pdev = emu_new_device( bus, ++devnums[bus] ) ) ) return -1;
+	put_le16( dev->desc + 8, vid );
+	put_le16( dev->desc + 10, pid );
+
+	for( i = 0; i < nopts; i++ )
+	{
+	    tok = opts[i];
+	    if( ( val = emu_opt( tok, "class" ) ) ) dev->desc[4] = strtoul( val, NULL, 0 );
+	    else if( ( val = emu_opt( tok, "caps" ) ) ) dev->caps = strtoul( val, NULL, 0 );
+	    else if( ( val = emu_opt( tok, "manufacturer" ) ) ) dev->strings[0] = strdup( val );
+	    else if( ( val = emu_opt( tok, "product" ) ) ) dev->strings[1] = strdup( val );
+	    else if( ( val = emu_opt( tok, "serial" ) ) ) dev->strings[2] = strdup( val );
+	    else if( ( val = emu_opt( tok, "speed" ) ) )
+	    {
+		if( !strcmp( val, "low" ) ) dev->speed = EMU_SPEED_LOW;
+		else if( !strcmp( val, "full" ) ) dev->speed = EMU_SPEED_FULL;
+		else if( !strcmp( val, "high" ) ) dev->speed = EMU_SPEED_HIGH;
+		else if( !strcmp( val, "super" ) ) dev->speed = EMU_SPEED_SUPER;
+		else return -1;
+	    }
+	    else return -1;
+	}
+	return 0;
+    }
+
+    if( !dev ) return -1;
+
+    if( !strcmp( cmd, "endpoint" ) )
+    {
+	struct emu_ep *ep;
+
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) || !( ep = emu_new_ep( dev, strtoul( tok, NULL, 0 ) ) ) ) return -1;
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) ) return -1;
+	if( !strcmp( tok, "bulk" ) ) ep->type = USB_URB_TYPE_BULK;
+	else if( !strcmp( tok, "interrupt" ) ) ep->type = USB_URB_TYPE_INTERRUPT;
+	else if( !strcmp( tok, "iso" ) ) ep->type = USB_URB_TYPE_ISO;
+	else return -1;
+
+	while( ( tok = strtok_r( NULL, " \t\r\n", &save ) ) )
+	{
+	    if( ( val = emu_opt( tok, "maxpacket" ) ) ) ep->maxpacket = strtoul( val, NULL, 0 );
+	    else if( ( val = emu_opt( tok, "interval" ) ) ) ep->interval = strtoul( val, NULL, 0 );
+	    else if( ( val = emu_opt( tok, "latency" ) ) ) ep->latency = strtoul( val, NULL, 0 );
+	    else if( ( val = emu_opt( tok, "bandwidth" ) ) ) ep->bandwidth = strtoul( val, NULL, 0 );
+	    else if( ( val = emu_opt( tok, "short" ) ) ) ep->short_len = strtoul( val, NULL, 0 );
+	    else return -1;
+	}
+	return 0;
+    }
+
+    if( !strcmp( cmd, "stall" ) )
+    {
+	struct emu_ep *ep;
+
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) || !( ep = emu_ep_get( dev, strtoul( tok, NULL, 0 ) ) ) ) return -1;
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) || !( val = emu_opt( tok, "after" ) ) ) return -1;
+	ep->stall_after = atoi( val );
+	return 0;
+    }
+
+    if( !strcmp( cmd, "connect" ) )
+    {
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) || !( val = emu_opt( tok, "after" ) ) ) return -1;
+	dev->connect_ms = atoi( val );
+	return 0;
+    }
+
+    if( !strcmp( cmd, "disconnect" ) )
+    {
+	if( !( tok = strtok_r( NULL, " \t\r\n", &save ) ) || !( val = emu_opt( tok, "after" ) ) ) return -1;
+	dev->disconnect_ms = atoi( val );
+	return 0;
+    }
+
+    if( !strcmp( cmd, "config" ) ) return emu_parse_config( dev, save );
+
+    return -1;
+}
+
+static void emu_cleanup(void)
+{
+    struct emu_device *dev;
+    char path[PATH_MAX];
+    int bus;
+
+    for( dev = emu_devices; dev; dev = dev->next )
+    {
+	unlink( dev->path );
+	emu_remove_sysfs( dev );
+    }
+    rmdir( emu_sysfs );
+    for( bus = 1; bus <= 255; bus++ )
+    {
+	snprintf( path, sizeof(path), "%s/%03d", emu_root, bus );
+	rmdir( path );
+    }
+    rmdir( emu_root );
+}
+
+static int emu_write_file( const char *dir, const char *name, const void *data, size_t len )
+{
+    char path[PATH_MAX + 16];
+    int fd, ret = 0;
+
+    snprintf( path, sizeof(path), "%s/%s", dir, name );
+    if( ( fd = open( path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 ) return -errno;
+    if( write( fd, data, len ) != (ssize_t)len ) ret = -EIO;
+    close( fd );
+    return ret;
+}
+
+/*
+ * The device's directory in the sysfs look-alike: root hubs are usbN, the
+ * others N-P after the hub port emu_portinfo() puts them on
+ */
+static int emu_make_sysfs( struct emu_device *dev )
+{
+    struct emu_device *other;
+    char num[16];
+    int port = 0, ports = 0, ret;
+
+    for( other = emu_devices; other; other = other->next )
+    {
+	if( other->busnum != dev->busnum || other->hub ) continue;
+	if( other == dev ) port = ports;
+	ports++;
+    }
+    if( dev->hub ) snprintf( dev->sysfs, sizeof(dev->sysfs), "%s/usb%d", emu_sysfs, dev->busnum );
+    else snprintf( dev->sysfs, sizeof(dev->sysfs), "%s/%d-%d", emu_sysfs, dev->busnum, port + 1 );
+    if( mkdir( dev->sysfs, 0755 ) < 0 ) return -errno;
+
+    if( dev->hub )
+    {
+	snprintf( num, sizeof(num), "%d\n", ports < EMU_MAX_PORTS ? ports : EMU_MAX_PORTS );
+	if( ( ret = emu_write_file( dev->sysfs, "maxchild", num, strlen( num ) ) ) < 0 ) return ret;
+    }
+
+    snprintf( num, sizeof(num), "%d\n", dev->busnum );
+    if( ( ret = emu_write_file( dev->sysfs, "busnum", num, strlen( num ) ) ) < 0 ) return ret;
+    snprintf( num, sizeof(num), "%d\n", dev->devnum );
+    if( ( ret = emu_write_file( dev->sysfs, "devnum", num, strlen( num ) ) ) < 0 ) return ret;
+    return emu_write_file( dev->sysfs, "descriptors", dev->blob, dev->blob_len );
+}
+
+/* Put the device's node and sysfs directory in place */
+static int emu_connect( struct emu_device *dev )
+{
+    int fd, ret;
+
+    snprintf( dev->path, sizeof(dev->path), "%s/%03d/%03d", emu_root, dev->busnum, dev->devnum );
+    if( ( fd = open( dev->path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644 ) ) < 0 ) return -errno;
+    close( fd );
+    if( ( ret = emu_make_sysfs( dev ) ) < 0 ) return ret;
+
+    dev->connect_at = 0;
+    emu_uevent( dev, "add" );
+    return 0;
+}
+
+/* Connects and disconnects happen on time, also while nobody touches the devices */
+static void *emu_hotplug_thread( void *arg )
+{
+    struct emu_device *dev;
+    int ret;
+
+    pthread_mutex_lock( &emu_lock );
+    for( ;; )
+    {
+	uint64_t now = emu_now(), next = UINT64_MAX;
+
+	for( dev = emu_devices; dev; dev = dev->next )
+	{
+	    if( dev->connect_at && now >= dev->connect_at && ( ret = emu_connect( dev ) ) < 0 )
+	    {
+		fprintf( stderr, "usbemu: couldn't connect %s: %s\n", dev->path, strerror(-ret) );
+		dev->connect_at = 0;
+	    }
+	    emu_check_gone( dev, now );
+	    if( dev->connect_at && dev->connect_at < next ) next = dev->connect_at;
+	    if( !dev->gone && dev->gone_at && dev->gone_at < next ) next = dev->gone_at;
+	}
+	emu_wait( next == UINT64_MAX ? 0 : next );
+    }
+    return NULL;
+}
+
+/* Placeholder files the PE side enumerates and opens, and what sysfs would have on them */
+static int emu_make_tree(void)
+{
+    const char *tmp = getenv( "TMPDIR" );
+    struct emu_device *dev;
+    char path[PATH_MAX];
+    uint64_t start = emu_now();
+    int ret;
+
+    snprintf( emu_root, sizeof(emu_root), "%s/libusb0-emu-XXXXXX", tmp && *tmp ? tmp : "/tmp" );
+    if( !mkdtemp( emu_root ) ) return -errno;
+    atexit( emu_cleanup );
+
+    snprintf( emu_sysfs, sizeof(emu_sysfs), "%s/sysfs", emu_root );
+    if( mkdir( emu_sysfs, 0755 ) < 0 ) return -errno;
+
+    for( dev = emu_devices; dev; dev = dev->next )
+    {
+	snprintf( path, sizeof(path), "%s/%03d", emu_root, dev->busnum );
+	if( mkdir( path, 0755 ) < 0 && errno != EEXIST ) return -errno;
+	if( dev->connect_ms ) dev->connect_at = start + (uint64_t)dev->connect_ms * 1000;
+	else if( ( ret = emu_connect( dev ) ) < 0 ) return ret;
+    }
+    return 0;
+}
+
+const struct usbfs_ops *usbemu_init( const char *path )
+{
+    struct emu_device *dev = NULL, *hub;
+    pthread_condattr_t attr;
+    pthread_t thread;
+    int devnums[256] = { 0 };
+    char line[4096];
+    int lineno = 0, bus, ret;
+    FILE *f;
+
+    if( !( f = fopen( path, "r" ) ) )
+    {
+	fprintf( stderr, "usbemu: couldn't open %s: %s\n", path, strerror(errno) );
+	return NULL;
+    }
+    while( fgets( line, sizeof(line), f ) )
+    {
+	lineno++;
+	if( emu_parse_line( line, &dev, devnums ) < 0 )
+	{
+	    fprintf( stderr, "usbemu: %s:%d: bad line\n", path, lineno );
+	    fclose( f );
+	    return NULL;
+	}
+    }
+    fclose( f );
+
+    for( bus = 1; bus <= 255; bus++ )
+    {
+	struct emu_ep *ep;
+
+	if( !devnums[bus] ) continue;
+	if( !( hub = emu_new_device( bus, 1 ) ) ) return NULL;
+	hub->hub = 1;
+	hub->desc[4] = EMU_CLASS_HUB;
+	put_le16( hub->desc + 8, 0x1d6b );	/* Linux Foundation */
+	put_le16( hub->desc + 10, 0x0002 );	/* 2.0 root hub */
+	if( ( ep = emu_new_ep( hub, 0x81 ) ) )
+	{
+	    ep->type = USB_URB_TYPE_INTERRUPT;
+	    ep->maxpacket = 4;
+	    ep->interval = 12;
+	}
+    }
+
+    for( dev = emu_devices; dev; dev = dev->next )
+	if( emu_finish_device( dev ) < 0 ) return NULL;
+
+    if( ( ret = emu_make_tree() ) < 0 )
+    {
+	fprintf( stderr, "usbemu: couldn't create %s: %s\n", emu_root, strerror(-ret) );
+	return NULL;
+    }
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &emu_cond, &attr );
+    pthread_condattr_destroy( &attr );
+
+    for( dev = emu_devices; dev; dev = dev->next )
+	if( dev->connect_ms || dev->disconnect_ms ) break;
+    if( dev && !pthread_create( &thread, NULL, emu_hotplug_thread, NULL ) ) pthread_detach( thread );
+
+    return &emu_ops;
+}
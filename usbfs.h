@@ -0,0 +1,70 @@
+/*
+ * usbfs ioctls and backends of the unix side
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __USBFS_H__
+#define __USBFS_H__
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+
+#include "linux.h"
+
+#define IOCTL_USB_CONTROL	_IOWR('U', 0, struct usb_ctrltransfer)
+#define IOCTL_USB_BULK		_IOWR('U', 2, struct usb_bulktransfer)
+#define IOCTL_USB_RESETEP	_IOR('U', 3, unsigned int)
+#define IOCTL_USB_SETINTF	_IOR('U', 4, struct usb_setinterface)
+#define IOCTL_USB_SETCONFIG	_IOR('U', 5, unsigned int)
+#define IOCTL_USB_GETDRIVER	_IOW('U', 8, struct usb_getdriver)
+#define IOCTL_USB_SUBMITURB	_IOR('U', 10, struct usb_urb)
+#define IOCTL_USB_DISCARDURB	_IO('U', 11)
+#define IOCTL_USB_REAPURB	_IOW('U', 12, void *)
+#define IOCTL_USB_REAPURBNDELAY	_IOW('U', 13, void *)
+#define IOCTL_USB_CLAIMINTF	_IOR('U', 15, unsigned int)
+#define IOCTL_USB_RELEASEINTF	_IOR('U', 16, unsigned int)
+#define IOCTL_USB_CONNECTINFO	_IOW('U', 17, struct usb_connectinfo)
+#define IOCTL_USB_IOCTL         _IOWR('U', 18, struct usb_ioctl)
+#define IOCTL_USB_HUB_PORTINFO	_IOR('U', 19, struct usb_hub_portinfo)
+#define IOCTL_USB_RESET		_IO('U', 20)
+#define IOCTL_USB_CLEAR_HALT	_IOR('U', 21, unsigned int)
+#define IOCTL_USB_DISCONNECT	_IO('U', 22)
+#define IOCTL_USB_CONNECT	_IO('U', 23)
+#define IOCTL_USB_GET_CAPABILITIES	_IOR('U', 26, uint32_t)
+
+/*
+ * Everything unixlib.c does to a usbfs fd goes through one of these, so the
+ * kernel can be swapped for the emulator in usbemu.c.
+ */
+struct usbfs_ops
+{
+    int (*open)( const char *name, int flags );
+    int (*close)( int fd );
+    ssize_t (*read)( int fd, void *buf, size_t count );
+    int (*ioctl)( int fd, unsigned long request, void *arg );
+    int (*poll)( struct pollfd *fds, nfds_t nfds, int timeout );
+    void *(*mmap)( void *addr, size_t length, int prot, int flags, int fd, off_t offset );
+    int (*munmap)( void *addr, size_t length );
+    const char *devfs_path;	/* usbfs tree to enumerate, NULL for the usual lookup */
+    const char *sysfs_path;	/* like /sys/bus/usb/devices, NULL if there is none */
+    int (*uevent_open)(void);	/* socket receiving the kernel's uevents, or -errno */
+};
+
+/* Emulated usbfs described by the device script at path, NULL on errors */
+const struct usbfs_ops *usbemu_init( const char *path );
+
+#endif /* __USBFS_H__ */
@@ -31,6 +31,29 @@ extern int usb_debug;
 	  ent->next = NULL; \
 	} while (0)
 
+/*
+ * Entries of a list by name, to match a new scan against the list we know
+ * in one pass rather than a strcmp loop per entry. Built for every scan,
+ * the lists themselves stay what applications walk.
+ */
+struct usb_index_slot {
+  const char *name;	/* NULL for never used */
+  void *entry;		/* NULL once taken */
+};
+
+struct usb_index {
+  unsigned int mask;	/* slots - 1, a power of two */
+  unsigned int count;	/* entries not taken yet */
+  struct usb_index_slot *slots;
+};
+
+int usb_index_init(struct usb_index *index, unsigned int count);
+void usb_index_add(struct usb_index *index, const char *name, void *entry);
+void *usb_index_find(struct usb_index *index, const char *name);
+void *usb_index_take(struct usb_index *index, const char *name);
+void *usb_index_next(struct usb_index *index, unsigned int *pos);
+void usb_index_free(struct usb_index *index);
+
 #define DESC_HEADER_LENGTH		2
 #define DEVICE_DESC_LENGTH		18
 #define CONFIG_DESC_LENGTH		9
@@ -38,6 +61,13 @@ extern int usb_debug;
 #define ENDPOINT_DESC_LENGTH		7
 #define ENDPOINT_AUDIO_DESC_LENGTH	9
 
+/* Position in a buffer of descriptors, see usb_descriptor_next */
+struct usb_descriptor_iter {
+  unsigned char *buffer;
+  int size;
+  int offset;
+};
+
 struct usb_dev_handle {
   int fd;
 
@@ -54,8 +84,16 @@ struct usb_dev_handle {
 
 /* descriptors.c */
 int usb_parse_descriptor(unsigned char *source, const char *description, void *dest);
-int usb_parse_configuration(struct usb_config_descriptor *config,
-	unsigned char *buffer);
+int usb_decode_header(const unsigned char *buffer, int size, struct usb_descriptor_header *dest);
+int usb_decode_device(const unsigned char *buffer, int size, struct usb_device_descriptor *dest);
+int usb_decode_config_prefix(const unsigned char *buffer, int size, struct usb_config_descriptor *dest);
+int usb_decode_config(const unsigned char *buffer, int size, struct usb_config_descriptor *dest);
+int usb_decode_interface(const unsigned char *buffer, int size, struct usb_interface_descriptor *dest);
+int usb_decode_endpoint(const unsigned char *buffer, int size, struct usb_endpoint_descriptor *dest);
+int usb_decode_endpoint_audio(const unsigned char *buffer, int size, struct usb_endpoint_descriptor *dest);
+void usb_descriptor_iter_init(struct usb_descriptor_iter *iter, unsigned char *buffer, int size);
+int usb_descriptor_next(struct usb_descriptor_iter *iter, struct usb_descriptor_header *header, int *offset);
+int usb_parse_configurations(struct usb_device *dev, unsigned char **buffers, const int *lengths, int count);
 void usb_fetch_and_parse_descriptors(usb_dev_handle *udev);
 void usb_destroy_configuration(struct usb_device *dev);
 
@@ -66,6 +104,8 @@ int usb_os_determine_children(struct usb_bus *bus);
 void usb_os_init(void);
 int usb_os_open(usb_dev_handle *dev);
 int usb_os_close(usb_dev_handle *dev);
+int usb_os_same_device(struct usb_device *dev, struct usb_device *ndev);
+void usb_os_free_device(struct usb_device *dev);
 
 void usb_free_dev(struct usb_device *dev);
 void usb_free_bus(struct usb_bus *bus);
@@ -0,0 +1,440 @@
+/*
+ * pcapng capture of the traffic going through the unix side
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   USB_PCAP=<file> writes every URB and control transfer the library
+ *   issues to file as pcapng with the LINUX_USB_MMAPPED link type, the
+ *   format usbmon captures in, so Wireshark decodes it like a capture
+ *   taken on the bus; %p in the name stands for the pid. No root or usbmon
+ *   needed, but only this process' traffic is in it.
+ *
+ *   The transfer path only copies the packet into a buffer. A writer
+ *   thread swaps buffers and writes the full one out, at the latest every
+ *   USBPCAP_FLUSH_MS. When the writer can't keep up packets are dropped
+ *   rather than stalling transfers, and counted in the interface
+ *   statistics written at exit. USB_PCAP_SNAPLEN caps the data bytes kept
+ *   per packet (default 65535).
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbpcap.h"
+
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_ISB		0x00000005
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1A2B3C4D
+
+#define USBPCAP_BUFFER		(8 * 1024 * 1024)	/* each of the two */
+#define USBPCAP_FLUSH_MS	100
+#define USBPCAP_DEFAULT_SNAPLEN	65535
+#define USBPCAP_MAX_FDS		4096
+#define USBPCAP_MAX_ISO_DESC	128
+
+/* usbmon's mon_bin_hdr, what LINKTYPE_USB_LINUX_MMAPPED packets start with */
+struct usbmon_packet
+{
+    uint64_t id;
+    uint8_t type;		/* 'S', 'C' or 'E' */
+    uint8_t xfer_type;		/* USB_URB_TYPE_* */
+    uint8_t epnum;
+    uint8_t devnum;
+    uint16_t busnum;
+    int8_t flag_setup;		/* 0 if setup is valid */
+    int8_t flag_data;		/* 0 if data follows */
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    union
+    {
+	uint8_t setup[8];
+	struct
+	{
+	    int32_t error_count;
+	    int32_t numdesc;
+	} iso;
+    } s;
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;		/* usbmon_iso_desc following */
+};
+
+struct usbmon_iso_desc
+{
+    int32_t status;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct pcapng_epb
+{
+    uint32_t type;
+    uint32_t length;
+    uint32_t interface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct usbpcap_buffer
+{
+    char *data;
+    size_t used;
+};
+
+int usbpcap;
+
+static int usbpcap_fd = -1;
+static uint32_t usbpcap_snaplen = USBPCAP_DEFAULT_SNAPLEN;
+static pthread_mutex_t usbpcap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usbpcap_cond;
+static struct usbpcap_buffer usbpcap_buffers[2];
+static struct usbpcap_buffer *usbpcap_fill = &usbpcap_buffers[0];
+static uint64_t usbpcap_drops;
+static int usbpcap_stop;
+static pthread_t usbpcap_thread;
+
+/* bus and device number of every fd opened, from its usbfs path */
+static struct { uint16_t bus; uint8_t dev; } usbpcap_addr[USBPCAP_MAX_FDS];
+
+static void usbpcap_write( const void *data, size_t size )
+{
+    const char *p = data;
+
+    while( size )
+    {
+	ssize_t ret = write( usbpcap_fd, p, size );
+
+	if( ret < 0 && errno == EINTR ) continue;
+	if( ret <= 0 )
+	{
+	    fprintf( stderr, "USB_PCAP: write failed: %s, capture stopped\n", strerror(errno) );
+	    usbpcap = 0;
+	    return;
+	}
+	p += ret;
+	size -= ret;
+    }
+}
+
+static uint64_t usbpcap_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usbpcap_write_headers(void)
+{
+    struct
+    {
+	uint32_t type, length, byte_order;
+	uint16_t major, minor;
+	int64_t section_length;
+	uint32_t length2;
+    } __attribute__((packed)) shb = { PCAPNG_SHB, sizeof(shb), PCAPNG_BYTE_ORDER, 1, 0, -1, sizeof(shb) };
+    struct
+    {
+	uint32_t type, length;
+	uint16_t linktype, reserved;
+	uint32_t snaplen;
+	uint16_t tsresol_code, tsresol_len;	/* if_tsresol: nanoseconds */
+	uint8_t tsresol, pad[3];
+	uint16_t end_code, end_len;
+	uint32_t length2;
+    } idb = { PCAPNG_IDB, sizeof(idb), LINKTYPE_USB_LINUX_MMAPPED, 0,
+	      sizeof(struct usbmon_packet) + USBPCAP_MAX_ISO_DESC * sizeof(struct usbmon_iso_desc) + usbpcap_snaplen,
+	      9, 1, 9, { 0 }, 0, 0, sizeof(idb) };
+
+    usbpcap_write( &shb, sizeof(shb) );
+    usbpcap_write( &idb, sizeof(idb) );
+}
+
+/* Interface statistics with the drop count, the last block of the file */
+static void usbpcap_write_stats(void)
+{
+    uint64_t now = usbpcap_now();
+    struct
+    {
+	uint32_t type, length, interface, ts_high, ts_low;
+	uint16_t drop_code, drop_len;	/* isb_ifdrop */
+	uint32_t drops_low, drops_high;
+	uint16_t end_code, end_len;
+	uint32_t length2;
+    } isb = { PCAPNG_ISB, sizeof(isb), 0, now >> 32, (uint32_t)now, 5, 8,
+	      (uint32_t)usbpcap_drops, usbpcap_drops >> 32, 0, 0, sizeof(isb) };
+
+    usbpcap_write( &isb, sizeof(isb) );
+}
+
+static void *usbpcap_writer( void *arg )
+{
+    pthread_mutex_lock( &usbpcap_lock );
+    for( ;; )
+    {
+	struct usbpcap_buffer *full = usbpcap_fill;
+	struct timespec deadline;
+
+	if( !full->used && !usbpcap_stop )
+	{
+	    clock_gettime( CLOCK_MONOTONIC, &deadline );
+	    deadline.tv_nsec += USBPCAP_FLUSH_MS * 1000000;
+	    if( deadline.tv_nsec >= 1000000000 )
+	    {
+		deadline.tv_nsec -= 1000000000;
+		deadline.tv_sec++;
+	    }
+	    pthread_cond_timedwait( &usbpcap_cond, &usbpcap_lock, &deadline );
+	    continue;
+	}
+	if( !full->used ) break;
+
+	/* Transfers go on filling the other buffer meanwhile */
+	usbpcap_fill = full == &usbpcap_buffers[0] ? &usbpcap_buffers[1] : &usbpcap_buffers[0];
+	pthread_mutex_unlock( &usbpcap_lock );
+
+	if( usbpcap ) usbpcap_write( full->data, full->used );
+	full->used = 0;
+
+	pthread_mutex_lock( &usbpcap_lock );
+    }
+    pthread_mutex_unlock( &usbpcap_lock );
+
+    return NULL;
+}
+
+static void usbpcap_exit(void)
+{
+    pthread_mutex_lock( &usbpcap_lock );
+    usbpcap_stop = 1;
+    pthread_cond_signal( &usbpcap_cond );
+    pthread_mutex_unlock( &usbpcap_lock );
+    pthread_join( usbpcap_thread, NULL );
+
+    usbpcap = 0;
+    usbpcap_write_stats();
+    close( usbpcap_fd );
+}
+
+void usbpcap_init(void)
+{
+    const char *name = getenv( "USB_PCAP" ), *env = getenv( "USB_PCAP_SNAPLEN" );
+    pthread_condattr_t attr;
+    char path[4096];
+    size_t len = 0;
+
+    if( !name || !*name ) return;
+
+    /* %p stands for the pid */
+    for( ; *name && len + 16 < sizeof(path); name++ )
+    {
+	if( name[0] == '%' && name[1] == 'p' )
+	{
+	    len += sprintf( path + len, "%d", (int)getpid() );
+	    name++;
+	}
+	else path[len++] = *name;
+    }
+    path[len] = 0;
+
+    if( env && atoi( env ) >= 0 ) usbpcap_snaplen = atoi( env );
+    if( usbpcap_snaplen > USBPCAP_BUFFER / 8 ) usbpcap_snaplen = USBPCAP_BUFFER / 8;
+
+    if( !( usbpcap_buffers[0].data = malloc( USBPCAP_BUFFER ) ) || !( usbpcap_buffers[1].data = malloc( USBPCAP_BUFFER ) ) )
+	return;
+
+    if( ( usbpcap_fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 )
+    {
+	fprintf( stderr, "USB_PCAP: couldn't create %s: %s\n", path, strerror(errno) );
+	return;
+    }
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &usbpcap_cond, &attr );
+    pthread_condattr_destroy( &attr );
+
+    usbpcap = 1;
+    usbpcap_write_headers();
+    if( !usbpcap || pthread_create( &usbpcap_thread, NULL, usbpcap_writer, NULL ) )
+    {
+	usbpcap = 0;
+	close( usbpcap_fd );
+	return;
+    }
+    atexit( usbpcap_exit );
+}
+
+/* Remember which device fd is, name ends in .../BBB/DDD */
+void usbpcap_open( int fd, const char *name )
+{
+    const char *slash = strrchr( name, '/' );
+    int bus = 0, dev = 0;
+
+    if( fd < 0 || fd >= USBPCAP_MAX_FDS || !slash ) return;
+
+    dev = atoi( slash + 1 );
+    while( slash > name && slash[-1] != '/' ) slash--;
+    if( slash > name ) bus = atoi( slash );
+
+    usbpcap_addr[fd].bus = bus;
+    usbpcap_addr[fd].dev = dev;
+}
+
+/*
+ * Append one packet to the fill buffer: usbmon header, ndesc ISO
+ * descriptors, then caplen of the len data bytes
+ */
+static void usbpcap_packet( const struct usbmon_packet *hdr, const struct usbmon_iso_desc *desc,
+			    const void *data, uint32_t caplen, uint32_t len )
+{
+    uint32_t pktlen = sizeof(*hdr) + hdr->ndesc * sizeof(*desc) + caplen;
+    uint32_t blocklen = sizeof(struct pcapng_epb) + ( ( pktlen + 3 ) & ~3 ) + 4;
+    uint64_t ts = (uint64_t)hdr->ts_sec * 1000000000 + (uint64_t)hdr->ts_usec * 1000;
+    struct pcapng_epb epb = { PCAPNG_EPB, blocklen, 0, ts >> 32, (uint32_t)ts, pktlen,
+			      sizeof(*hdr) + hdr->ndesc * sizeof(*desc) + len };
+    struct usbpcap_buffer *buf;
+    char *p;
+
+    pthread_mutex_lock( &usbpcap_lock );
+    buf = usbpcap_fill;
+    if( buf->used + blocklen > USBPCAP_BUFFER )
+    {
+	usbpcap_drops++;
+	pthread_cond_signal( &usbpcap_cond );
+	pthread_mutex_unlock( &usbpcap_lock );
+	return;
+    }
+
+    p = buf->data + buf->used;
+    memcpy( p, &epb, sizeof(epb) );
+    p += sizeof(epb);
+    memcpy( p, hdr, sizeof(*hdr) );
+    p += sizeof(*hdr);
+    if( hdr->ndesc ) memcpy( p, desc, hdr->ndesc * sizeof(*desc) );
+    p += hdr->ndesc * sizeof(*desc);
+    if( caplen ) memcpy( p, data, caplen );
+    p += caplen;
+    memset( p, 0, ( 4 - pktlen % 4 ) % 4 );
+    p += ( 4 - pktlen % 4 ) % 4;
+    memcpy( p, &blocklen, 4 );
+    buf->used += blocklen;
+
+    if( buf->used > USBPCAP_BUFFER / 4 ) pthread_cond_signal( &usbpcap_cond );
+    pthread_mutex_unlock( &usbpcap_lock );
+}
+
+static void usbpcap_header( struct usbmon_packet *hdr, int fd, char event, uint64_t id, int type, int ep, int status )
+{
+    uint64_t now = usbpcap_now();
+
+    memset( hdr, 0, sizeof(*hdr) );
+    hdr->id = id;
+    hdr->type = event;
+    hdr->xfer_type = type;
+    hdr->epnum = ep;
+    if( fd >= 0 && fd < USBPCAP_MAX_FDS )
+    {
+	hdr->busnum = usbpcap_addr[fd].bus;
+	hdr->devnum = usbpcap_addr[fd].dev;
+    }
+    hdr->flag_setup = '-';
+    hdr->ts_sec = now / 1000000000;
+    hdr->ts_usec = now % 1000000000 / 1000;
+    /* usbmon reports submissions as still in progress */
+    hdr->status = event == 'S' ? -EINPROGRESS : status;
+}
+
+void usbpcap_urb( int fd, char event, const struct usb_urb *urb, int status )
+{
+    struct usbmon_iso_desc desc[USBPCAP_MAX_ISO_DESC];
+    struct usbmon_packet hdr;
+    int in = urb->endpoint & 0x80;
+    uint32_t len;
+
+    usbpcap_header( &hdr, fd, event, (uintptr_t)urb, urb->type, urb->endpoint, status );
+    hdr.xfer_flags = urb->flags;
+    hdr.start_frame = urb->start_frame;
+
+    if( urb->type == USB_URB_TYPE_ISO )
+    {
+	uint32_t offset = 0;
+	int i;
+
+	hdr.s.iso.error_count = event == 'C' ? urb->error_count : 0;
+	hdr.s.iso.numdesc = urb->number_of_packets;
+	for( i = 0; i < urb->number_of_packets && i < USBPCAP_MAX_ISO_DESC; i++ )
+	{
+	    desc[i].status = event == 'C' ? (int)urb->iso_frame_desc[i].status : -EXDEV;
+	    desc[i].offset = offset;
+	    desc[i].len = event == 'C' ? urb->iso_frame_desc[i].actual_length : urb->iso_frame_desc[i].length;
+	    desc[i].pad = 0;
+	    offset += urb->iso_frame_desc[i].length;
+	}
+	hdr.ndesc = i;
+    }
+
+    /* Data goes out with the submission and comes in with the completion */
+    hdr.length = event == 'C' ? urb->actual_length : urb->buffer_length;
+    if( event == 'E' || ( event == 'S' ) == !!in )
+    {
+	hdr.flag_data = in ? '<' : '>';
+	len = 0;
+    }
+    else len = urb->type == USB_URB_TYPE_ISO ? urb->buffer_length : hdr.length;
+
+    hdr.len_cap = len < usbpcap_snaplen ? len : usbpcap_snaplen;
+    usbpcap_packet( &hdr, desc, urb->buffer, hdr.len_cap, len );
+}
+
+void usbpcap_control( int fd, char event, uint64_t id, const uint8_t setup[8], const void *data, int length, int status )
+{
+    struct usbmon_packet hdr;
+    int in = setup[0] & 0x80;
+    uint32_t len = 0;
+
+    usbpcap_header( &hdr, fd, event, id, USB_URB_TYPE_CONTROL, in, status );
+    if( event == 'S' )
+    {
+	hdr.flag_setup = 0;
+	memcpy( hdr.s.setup, setup, 8 );
+    }
+
+    hdr.length = length > 0 ? length : 0;
+    if( event == 'E' || ( event == 'S' ) == !!in || !hdr.length ) hdr.flag_data = in ? '<' : '>';
+    else len = hdr.length;
+
+    hdr.len_cap = len < usbpcap_snaplen ? len : usbpcap_snaplen;
+    usbpcap_packet( &hdr, NULL, data, hdr.len_cap, len );
+}
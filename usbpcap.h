@@ -0,0 +1,39 @@
+/*
+ * pcapng capture of the traffic going through the unix side
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __USBPCAP_H__
+#define __USBPCAP_H__
+
+#include "linux.h"
+
+/* Set while USB_PCAP is active */
+extern int usbpcap;
+
+void usbpcap_init(void);
+void usbpcap_open( int fd, const char *name );
+void usbpcap_urb( int fd, char event, const struct usb_urb *urb, int status );
+void usbpcap_control( int fd, char event, uint64_t id, const uint8_t setup[8], const void *data, int length, int status );
+
+/* event is 'S' (submitted), 'C' (completed) or 'E' (submission failed), as in usbmon */
+#define USBPCAP_URB( fd, event, urb, status ) \
+    do { if( usbpcap ) usbpcap_urb( fd, event, urb, status ); } while (0)
+
+#define USBPCAP_CONTROL( fd, event, id, setup, data, length, status ) \
+    do { if( usbpcap ) usbpcap_control( fd, event, id, setup, data, length, status ); } while (0)
+
+#endif /* __USBPCAP_H__ */
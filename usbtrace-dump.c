@@ -0,0 +1,243 @@
+/*
+ * usbtrace-dump - decode a USB_TRACE file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   usbtrace-dump [-f] [-s us] <file>
+ *
+ *   Prints the records still in the ring, oldest first, one per line with
+ *   the time since the first of them. Reaps and finished control transfers
+ *   also show how long ago they were submitted. -f keeps following the
+ *   file while the traced process writes it, -s only prints completions
+ *   that took at least that many us, to find the spikes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usbtrace.h"
+
+/* Submit times of URBs in flight, keyed by URB address */
+#define INFLIGHT_SIZE	4096
+
+struct inflight
+{
+    uint64_t urb;
+    uint64_t time;
+};
+
+static struct inflight inflight[INFLIGHT_SIZE];
+
+static const char * const event_names[] =
+{
+    "open", "close", "submit", "reap", "discard", "timeout", "ctrl", "ctrl-done",
+};
+
+static const char * const type_names[] = { "iso", "int", "ctrl", "bulk" };
+
+static struct inflight *inflight_slot( uint64_t urb, int insert )
+{
+    unsigned int i = ( urb >> 4 ) * 2654435761u % INFLIGHT_SIZE, n;
+
+    for( n = 0; n < INFLIGHT_SIZE; n++, i = ( i + 1 ) % INFLIGHT_SIZE )
+    {
+	if( inflight[i].urb == urb ) return &inflight[i];
+	if( !inflight[i].urb ) return insert ? &inflight[i] : NULL;
+    }
+    return NULL;
+}
+
+/* Control transfers are keyed by fd and setup packet instead */
+static uint64_t inflight_key( const struct usbtrace_record *r )
+{
+    if( r->event == USBTRACE_CONTROL_SUBMIT || r->event == USBTRACE_CONTROL_DONE )
+	return ( r->urb ^ (uint64_t)r->fd << 40 ^ (uint64_t)r->tid << 20 ) | 1;
+    return r->urb;
+}
+
+/* Remove a slot without breaking the probe chains behind it */
+static void inflight_remove( struct inflight *slot )
+{
+    unsigned int i = slot - inflight, j = i;
+
+    inflight[i].urb = 0;
+    for( ;; )
+    {
+	unsigned int home;
+
+	j = ( j + 1 ) % INFLIGHT_SIZE;
+	if( !inflight[j].urb ) break;
+	home = ( inflight[j].urb >> 4 ) * 2654435761u % INFLIGHT_SIZE;
+	if( ( j > i && ( home <= i || home > j ) ) || ( j < i && home <= i && home > j ) )
+	{
+	    inflight[i] = inflight[j];
+	    inflight[j].urb = 0;
+	    i = j;
+	}
+    }
+}
+
+static void print_record( const struct usbtrace_record *r, uint64_t start, uint64_t min_us )
+{
+    int64_t took = -1;
+    uint64_t key = inflight_key( r );
+    struct inflight *slot;
+
+    switch( r->event )
+    {
+	case USBTRACE_SUBMIT:
+	case USBTRACE_CONTROL_SUBMIT:
+	    if( r->status >= 0 && key && ( slot = inflight_slot( key, 1 ) ) )
+	    {
+		slot->urb = key;
+		slot->time = r->time;
+	    }
+	    break;
+
+	case USBTRACE_REAP:
+	case USBTRACE_CONTROL_DONE:
+	    if( key && ( slot = inflight_slot( key, 0 ) ) )
+	    {
+		took = ( r->time - slot->time ) / 1000;
+		inflight_remove( slot );
+	    }
+	    break;
+    }
+
+    if( min_us && ( took < 0 || (uint64_t)took < min_us ) ) return;
+
+    printf( "%12.6f %7u fd %-3d %-9s", ( r->time - start ) / 1e9, r->tid, r->fd,
+	    r->event < sizeof(event_names) / sizeof(event_names[0]) ? event_names[r->event] : "?" );
+
+    switch( r->event )
+    {
+	case USBTRACE_OPEN:
+	case USBTRACE_CLOSE:
+	    printf( " status %d", r->status );
+	    break;
+
+	case USBTRACE_CONTROL_SUBMIT:
+	case USBTRACE_CONTROL_DONE:
+	    printf( " %02x %02x %04x %04x %04x len %d status %d", (unsigned int)( r->urb & 0xff ),
+		    (unsigned int)( r->urb >> 8 & 0xff ), (unsigned int)( r->urb >> 16 & 0xffff ),
+		    (unsigned int)( r->urb >> 32 & 0xffff ), (unsigned int)( r->urb >> 48 & 0xffff ),
+		    r->length, r->status );
+	    break;
+
+	default:
+	    printf( " ep 0x%02x %-4s urb %#llx len %d status %d", r->ep,
+		    r->type < 4 ? type_names[r->type] : "?", (unsigned long long)r->urb, r->length, r->status );
+	    break;
+    }
+    if( took >= 0 ) printf( " +%lldus", (long long)took );
+    printf( "\n" );
+}
+
+/* Copy out record index, 0 if it has been overwritten or is still being written */
+static int read_record( const struct usbtrace_header *h, uint64_t index, struct usbtrace_record *out )
+{
+    const struct usbtrace_record *r = (const struct usbtrace_record *)( h + 1 ) + ( index & ( h->capacity - 1 ) );
+    uint64_t seq = __atomic_load_n( &r->seq, __ATOMIC_ACQUIRE );
+
+    if( seq != index + 1 ) return 0;
+    memcpy( out, r, sizeof(*out) );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    return __atomic_load_n( &r->seq, __ATOMIC_RELAXED ) == seq;
+}
+
+int main( int argc, char **argv )
+{
+    const struct usbtrace_header *h;
+    uint64_t next, start = 0, min_us = 0;
+    int follow = 0, opt, fd;
+    struct stat st;
+
+    while( ( opt = getopt( argc, argv, "fs:" ) ) != -1 )
+    {
+	switch( opt )
+	{
+	    case 'f': follow = 1; break;
+	    case 's': min_us = strtoull( optarg, NULL, 0 ); break;
+	    default:
+		fprintf( stderr, "usage: %s [-f] [-s us] <file>\n", argv[0] );
+		return 2;
+	}
+    }
+    if( optind + 1 != argc )
+    {
+	fprintf( stderr, "usage: %s [-f] [-s us] <file>\n", argv[0] );
+	return 2;
+    }
+
+    if( ( fd = open( argv[optind], O_RDONLY ) ) < 0 || fstat( fd, &st ) < 0 )
+    {
+	fprintf( stderr, "%s: %s\n", argv[optind], strerror(errno) );
+	return 1;
+    }
+    if( st.st_size < (off_t)sizeof(*h) ||
+	( h = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ||
+	memcmp( h->magic, USBTRACE_MAGIC, sizeof(h->magic) ) || h->version != USBTRACE_VERSION ||
+	h->record_size != sizeof(struct usbtrace_record) || !h->capacity || ( h->capacity & ( h->capacity - 1 ) ) ||
+	(off_t)( sizeof(*h) + h->capacity * sizeof(struct usbtrace_record) ) > st.st_size )
+    {
+	fprintf( stderr, "%s: not a usb trace\n", argv[optind] );
+	return 1;
+    }
+    close( fd );
+
+    printf( "pid %u, %llu records written, ring of %llu\n", h->pid,
+	    (unsigned long long)__atomic_load_n( &h->head, __ATOMIC_ACQUIRE ), (unsigned long long)h->capacity );
+
+    next = __atomic_load_n( &h->head, __ATOMIC_ACQUIRE );
+    next = next > h->capacity ? next - h->capacity : 0;
+
+    for( ;; )
+    {
+	uint64_t head = __atomic_load_n( &h->head, __ATOMIC_ACQUIRE );
+
+	if( head - next > h->capacity )
+	{
+	    printf( "... %llu records lost\n", (unsigned long long)( head - h->capacity - next ) );
+	    next = head - h->capacity;
+	}
+
+	for( ; next < head; next++ )
+	{
+	    struct usbtrace_record r;
+
+	    /* A writer that hasn't published yet, try again later */
+	    if( !read_record( h, next, &r ) )
+	    {
+		if( head - next < h->capacity / 2 && follow ) break;
+		continue;
+	    }
+	    if( !start ) start = r.time;
+	    print_record( &r, start, min_us );
+	}
+
+	if( !follow ) break;
+	fflush( stdout );
+	usleep( 100000 );
+    }
+
+    return 0;
+}
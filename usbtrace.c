@@ -0,0 +1,147 @@
+/*
+ * URB trace ring
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   USB_TRACE=<file> records every URB submitted, reaped, discarded or
+ *   timed out and every control transfer into a ring mmap'd from file,
+ *   %p in the name standing for the pid. USB_TRACE_RECORDS sets the size
+ *   of the ring (default 65536, 48 bytes each). Writing a record takes a
+ *   clock read, an atomic add and a few stores, no lock and no syscall;
+ *   the kernel writes the pages back on its own. usbtrace-dump decodes
+ *   the file, also while it is being written.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "usbtrace.h"
+
+#define USBTRACE_DEFAULT_RECORDS	65536
+#define USBTRACE_MAX_RECORDS		(1 << 24)
+
+struct usbtrace_header *usbtrace;
+static struct usbtrace_record *usbtrace_ring;
+static uint64_t usbtrace_mask;
+
+static __thread uint32_t usbtrace_tid;
+
+static uint64_t usbtrace_clock( clockid_t clock )
+{
+    struct timespec ts;
+
+    clock_gettime( clock, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* name with %p replaced by the pid */
+static int usbtrace_path( const char *name, char *path, size_t size )
+{
+    size_t len = 0;
+
+    for( ; *name && len + 1 < size; name++ )
+    {
+	if( name[0] == '%' && name[1] == 'p' )
+	{
+	    len += snprintf( path + len, size - len, "%d", (int)getpid() );
+	    name++;
+	}
+	else path[len++] = *name;
+    }
+    if( *name || len >= size ) return -ENAMETOOLONG;
+    path[len] = 0;
+    return 0;
+}
+
+void usbtrace_init(void)
+{
+    const char *name = getenv( "USB_TRACE" ), *env = getenv( "USB_TRACE_RECORDS" );
+    uint64_t records = USBTRACE_DEFAULT_RECORDS, capacity = 1;
+    struct usbtrace_header *header;
+    char path[4096];
+    size_t size;
+    int fd;
+
+    if( !name || !*name ) return;
+
+    if( env && atoll( env ) > 0 ) records = atoll( env );
+    if( records > USBTRACE_MAX_RECORDS ) records = USBTRACE_MAX_RECORDS;
+    while( capacity < records ) capacity <<= 1;
+
+    if( usbtrace_path( name, path, sizeof(path) ) < 0 )
+    {
+	fprintf( stderr, "USB_TRACE: %s is too long\n", name );
+	return;
+    }
+
+    size = sizeof(*header) + capacity * sizeof(struct usbtrace_record);
+    if( ( fd = open( path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 )
+    {
+	fprintf( stderr, "USB_TRACE: couldn't create %s: %s\n", path, strerror(errno) );
+	return;
+    }
+    if( ftruncate( fd, size ) < 0 ||
+	( header = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) == MAP_FAILED )
+    {
+	fprintf( stderr, "USB_TRACE: couldn't map %s: %s\n", path, strerror(errno) );
+	close( fd );
+	return;
+    }
+    close( fd );
+
+    header->version = USBTRACE_VERSION;
+    header->record_size = sizeof(struct usbtrace_record);
+    header->capacity = capacity;
+    header->head = 0;
+    header->realtime_offset = usbtrace_clock( CLOCK_REALTIME ) - usbtrace_clock( CLOCK_MONOTONIC );
+    header->pid = getpid();
+    /* The magic goes in last, a reader sees either nothing or a valid header */
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    memcpy( header->magic, USBTRACE_MAGIC, sizeof(header->magic) );
+
+    usbtrace_ring = (struct usbtrace_record *)( header + 1 );
+    usbtrace_mask = capacity - 1;
+    usbtrace = header;
+}
+
+void usbtrace_write( int event, int fd, int ep, int type, uint64_t urb, int length, int status )
+{
+    uint64_t index = __atomic_fetch_add( &usbtrace->head, 1, __ATOMIC_RELAXED );
+    struct usbtrace_record *r = &usbtrace_ring[index & usbtrace_mask];
+
+    if( !usbtrace_tid ) usbtrace_tid = syscall( SYS_gettid );
+
+    __atomic_store_n( &r->seq, 0, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    r->time = usbtrace_clock( CLOCK_MONOTONIC );
+    r->urb = urb;
+    r->fd = fd;
+    r->length = length;
+    r->status = status;
+    r->tid = usbtrace_tid;
+    r->event = event;
+    r->ep = ep;
+    r->type = type;
+    __atomic_store_n( &r->seq, index + 1, __ATOMIC_RELEASE );
+}
@@ -0,0 +1,88 @@
+/*
+ * URB trace ring, shared by the unix side and usbtrace-dump
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * NOTES:
+ *   The trace file is a header followed by a power of two of fixed size
+ *   records, mmap'd shared by the process writing it, so it is on disk
+ *   and readable by others while the process runs. Writers claim a slot
+ *   by bumping head and publish the record by storing its seq last; a
+ *   reader takes a record only if seq is the same before and after
+ *   copying it.
+ */
+
+#ifndef __USBTRACE_H__
+#define __USBTRACE_H__
+
+#include <stdint.h>
+
+#define USBTRACE_MAGIC		"USBTRACE"
+#define USBTRACE_VERSION	1
+
+enum usbtrace_event
+{
+    USBTRACE_OPEN,		/* status: fd or -errno */
+    USBTRACE_CLOSE,
+    USBTRACE_SUBMIT,		/* length: buffer length */
+    USBTRACE_REAP,		/* length: actual length, status: URB status */
+    USBTRACE_DISCARD,		/* status: 0 or -errno */
+    USBTRACE_TIMEOUT,		/* a wait gave up on a URB of ep */
+    USBTRACE_CONTROL_SUBMIT,	/* urb: setup packet, length: wLength */
+    USBTRACE_CONTROL_DONE,	/* urb: setup packet, length: bytes transferred */
+};
+
+struct usbtrace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;		/* records, a power of two */
+    uint64_t head;		/* records written so far, the ring keeps the last capacity of them */
+    int64_t realtime_offset;	/* ns from CLOCK_MONOTONIC to CLOCK_REALTIME */
+    uint32_t pid;
+    uint8_t pad[20];
+};
+
+struct usbtrace_record
+{
+    uint64_t seq;		/* index + 1, 0 while the record is written */
+    uint64_t time;		/* ns, CLOCK_MONOTONIC */
+    uint64_t urb;		/* unix side address of the URB, setup packet for control */
+    int32_t fd;
+    int32_t length;
+    int32_t status;
+    uint32_t tid;
+    uint8_t event;		/* enum usbtrace_event */
+    uint8_t ep;
+    uint8_t type;		/* USB_URB_TYPE_* */
+    uint8_t pad[5];
+};
+
+#ifdef WINE_UNIX_LIB
+
+/* Set while USB_TRACE is active */
+extern struct usbtrace_header *usbtrace;
+
+void usbtrace_init(void);
+void usbtrace_write( int event, int fd, int ep, int type, uint64_t urb, int length, int status );
+
+/* Costs one predictable branch when tracing is off */
+#define USBTRACE( event, fd, ep, type, urb, length, status ) \
+    do { if( usbtrace ) usbtrace_write( event, fd, ep, type, urb, length, status ); } while (0)
+
+#endif  /* WINE_UNIX_LIB */
+
+#endif /* __USBTRACE_H__ */